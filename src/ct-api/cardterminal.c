@@ -20,12 +20,28 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+/* CPU affinity of the worker thread */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "defines.h"
 #include "cardterminal.h"
 #include "atr.h"
 #include "atr_sync.h"
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD_H
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef OS_LINUX
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#endif
 
 /*
  * Not exported constants definition
@@ -33,10 +49,35 @@
 
 #define CARDTERMINAL_RESETCT_BUFFER_SIZE	35
 #define CARDTERMINAL_REQUESTICC_BUFFER_SIZE	35
-#define CARDTERMINAL_GETSTATUS_BUFFER_SIZE	19
+#define CARDTERMINAL_STATUS_COUNTERS		25
+#define CARDTERMINAL_STATUS_COUNTERS_SIZE	(4 * CARDTERMINAL_STATUS_COUNTERS + 2)
+#define CARDTERMINAL_STATUS_HISTOGRAM_SIZE	(4 * (IO_SERIAL_STATS_BUCKETS + 3) + 2)
+#define CARDTERMINAL_GETSTATUS_BUFFER_SIZE	MAX (CARDTERMINAL_STATUS_COUNTERS_SIZE, CARDTERMINAL_STATUS_HISTOGRAM_SIZE)
 #define CARDTERMINAL_EJECTICC_BUFFER_SIZE	2
 #define CARDTERMINAL_MANUFACTURER		"DETWK"
 
+/* Environment variable enabling a worker thread per card-terminal */
+#define CARDTERMINAL_WORKER_ENV			"TOWITOKO_WORKER"
+
+/*
+ * Not exported datatypes definition
+ */
+
+#ifdef HAVE_PTHREAD_H
+/* Transaction to be started by CardTerminal_Hold */
+typedef struct
+{
+  CardTerminal * ct;
+  pthread_t owner;
+  unsigned timeout;
+}
+CardTerminal_Transaction;
+#endif
+
+/* Does not compile if the GET STATUS counters outgrow the response buffer */
+typedef char CardTerminal_StatusCountersFit
+  [(CARDTERMINAL_GETSTATUS_BUFFER_SIZE >= CARDTERMINAL_STATUS_COUNTERS_SIZE) ? 1 : -1];
+
 /* 
  * Not exported functions declaration
  */
@@ -56,6 +97,71 @@ CardTerminal_EjectICC (CardTerminal * ct, APDU_Cmd * cmd, APDU_Rsp ** rsp);
 static void 
 CardTerminal_Clear (CardTerminal * ct);
 
+static unsigned
+CardTerminal_PutCounter (BYTE * buffer, unsigned long counter);
+
+static unsigned
+CardTerminal_PutCounters (BYTE * buffer, IO_Serial_Stats * stats, CardTerminal_Stats * ct_stats);
+
+static unsigned
+CardTerminal_PutHistogram (BYTE * buffer, IO_Serial_Histogram * hist);
+
+static bool
+CardTerminal_Reconnect (CardTerminal * ct);
+
+#ifdef HAVE_PTHREAD_H
+static bool
+CardTerminal_StartWorker (CardTerminal * ct, unsigned short pn);
+
+static void
+CardTerminal_StopWorker (CardTerminal * ct);
+
+static void *
+CardTerminal_Worker (void * arg);
+
+static void
+CardTerminal_Stop (void * arg);
+
+static bool
+CardTerminal_IsPreempted (CardTerminal * ct, int priority);
+
+static bool
+CardTerminal_IsOwner (CardTerminal * ct);
+
+static bool
+CardTerminal_IsHeld (CardTerminal * ct);
+
+static void
+CardTerminal_WaitTurn (CardTerminal * ct);
+
+static bool
+CardTerminal_IsPast (struct timespec * time);
+
+static void
+CardTerminal_WaitUntil (CardTerminal * ct, struct timespec * time);
+
+static void
+CardTerminal_Hold (void * arg);
+
+static void *
+CardTerminal_Prober (void * arg);
+
+static void
+CardTerminal_Probe (void * arg);
+
+static void
+CardTerminal_Push (CardTerminal_Queue * queue, CardTerminal_Request * request);
+
+static CardTerminal_Request *
+CardTerminal_Pop (CardTerminal_Queue * queue);
+
+static void
+CardTerminal_Wait (volatile int * address, int value);
+
+static void
+CardTerminal_Wake (volatile int * address);
+#endif
+
 /*
  * Exported functions definition
  */
@@ -155,11 +261,197 @@ CardTerminal_Init (CardTerminal * ct, unsigned short pn)
     }
 #ifdef HAVE_PTHREAD_H
     else
-      pthread_mutex_init(&(ct->mutex), NULL);
+      {
+        pthread_mutex_init(&(ct->mutex), NULL);
+        pthread_cond_init(&(ct->cond), NULL);
+
+        /* Without a worker, callers take turns under the mutex */
+        if (getenv (CARDTERMINAL_WORKER_ENV) != NULL)
+          ct->worker = CardTerminal_StartWorker (ct, pn);
+      }
+#endif
+  return ret;
+}
+
+void
+CardTerminal_Execute (CardTerminal * ct, int priority, void (*run) (void *), void * arg)
+{
+#ifdef HAVE_PTHREAD_H
+  CardTerminal_Request request;
+  unsigned long ticket;
+  bool owner;
+
+  /* The owner of a transaction runs at once, the worker is idle for it */
+  owner = FALSE;
+
+  if (ct->owned)
+    {
+      pthread_mutex_lock (&(ct->mutex));
+
+      owner = CardTerminal_IsHeld (ct) && CardTerminal_IsOwner (ct);
+
+      if (owner)
+        ct->busy = TRUE;
+
+      pthread_mutex_unlock (&(ct->mutex));
+    }
+
+  if (!owner && ct->worker)
+    {
+      request.run = run;
+      request.arg = arg;
+      request.done = 0;
+
+      __sync_fetch_and_add (&(ct->pending[priority]), 1);
+      CardTerminal_Push (&(ct->queues[priority]), &request);
+
+      __sync_fetch_and_add (&(ct->queued), 1);
+      CardTerminal_Wake (&(ct->queued));
+
+      while (!request.done)
+        CardTerminal_Wait (&(request.done), 0);
+
+      return;
+    }
+
+  if (!owner)
+    {
+      pthread_mutex_lock (&(ct->mutex));
+      ct->pending[priority]++;
+      ticket = ct->tickets[priority]++;
+
+      /* Wait for the running request, transaction, earlier ones and higher priorities */
+      while (ct->busy || CardTerminal_IsHeld (ct) || (ct->served[priority] != ticket) ||
+             CardTerminal_IsPreempted (ct, priority))
+        CardTerminal_WaitTurn (ct);
+
+      ct->pending[priority]--;
+      ct->served[priority]++;
+      ct->busy = TRUE;
+      pthread_mutex_unlock (&(ct->mutex));
+    }
+
+  run (arg);
+
+  pthread_mutex_lock (&(ct->mutex));
+  ct->busy = FALSE;
+  pthread_cond_broadcast (&(ct->cond));
+  pthread_mutex_unlock (&(ct->mutex));
+#else
+  run (arg);
+#endif
+}
+
+char
+CardTerminal_BeginTransaction (CardTerminal * ct, unsigned timeout)
+{
+#ifdef HAVE_PTHREAD_H
+  CardTerminal_Transaction transaction;
+
+  transaction.ct = ct;
+  transaction.owner = pthread_self ();
+  transaction.timeout = timeout;
+
+  /* Taken in turn as a command to a card, or renewed by the owner */
+  CardTerminal_Execute (ct, CARDTERMINAL_PRIORITY_HIGH, CardTerminal_Hold, &transaction);
+#endif
+  return OK;
+}
+
+char
+CardTerminal_EndTransaction (CardTerminal * ct)
+{
+  char ret;
+
+  ret = OK;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&(ct->mutex));
+
+  /* Not held by this thread, or timed out and taken by another */
+  if (CardTerminal_IsOwner (ct))
+    {
+      ct->owned = FALSE;
+      pthread_cond_broadcast (&(ct->cond));
+    }
+  else
+    ret = ERR_INVALID;
+
+  pthread_mutex_unlock (&(ct->mutex));
 #endif
   return ret;
 }
 
+int
+CardTerminal_GetPending (CardTerminal * ct, int priority)
+{
+#ifdef HAVE_PTHREAD_H
+  return ct->pending[priority];
+#else
+  return 0;
+#endif
+}
+
+bool
+CardTerminal_Admit (CardTerminal * ct)
+{
+#ifdef HAVE_PTHREAD_H
+  if (ct->tripped)
+    {
+      __sync_fetch_and_add (&(ct->stats.rejected), 1);
+      return FALSE;
+    }
+#endif
+  return TRUE;
+}
+
+void
+CardTerminal_Report (CardTerminal * ct, char ret)
+{
+  /* A failure that reopened the serial device is not the reader's once it answers */
+  if ((ct->reopens != ct->io->stats.io_reopens) && CardTerminal_Reconnect (ct))
+    ret = OK;
+
+#ifdef HAVE_PTHREAD_H
+  /* Only a reader not answering trips, not a card refusing a command */
+  if (ret != ERR_TRANS)
+    {
+      ct->failures = 0;
+      return;
+    }
+
+  if (++(ct->failures) < CARDTERMINAL_BREAKER_FAILURES)
+    return;
+
+  ct->failures = 0;
+
+  /* A silent card fails the same way, so the reader is asked before tripping */
+  if (ct->tripped || (IFD_Towitoko_GetReaderInfo (ct->slots[0]->ifd) == IFD_TOWITOKO_OK))
+    return;
+
+  pthread_mutex_lock (&(ct->mutex));
+
+  ct->tripped = TRUE;
+  ct->stats.trips++;
+
+  /* A prober leaving the loop only unlocks and returns, so it is joined at once */
+  if (!ct->probing)
+    {
+      if (ct->probed)
+	pthread_join (ct->prober, NULL);
+
+      ct->probed = (pthread_create (&(ct->prober), NULL, CardTerminal_Prober, ct) == 0);
+      ct->probing = ct->probed;
+
+      /* Without a prober the reader would never be admitted again */
+      if (!ct->probing)
+	ct->tripped = FALSE;
+    }
+
+  pthread_mutex_unlock (&(ct->mutex));
+#endif
+}
+
 char
 CardTerminal_Command (CardTerminal * ct, APDU_Cmd * cmd, APDU_Rsp ** rsp)
 {
@@ -216,6 +508,30 @@ CardTerminal_Command (CardTerminal * ct, APDU_Cmd * cmd, APDU_Rsp ** rsp)
   return ret;
 }
 
+void
+CardTerminal_Drain (CardTerminal * ct)
+{
+#ifdef HAVE_PTHREAD_H
+  /* An open transaction ends with the card-terminal */
+  pthread_mutex_lock (&(ct->mutex));
+  ct->owned = FALSE;
+  ct->tripped = FALSE;
+  pthread_cond_broadcast (&(ct->cond));
+  pthread_mutex_unlock (&(ct->mutex));
+
+  /* The prober may have a request to run, so it goes before the worker */
+  if (ct->probed)
+    {
+      pthread_join (ct->prober, NULL);
+      ct->probed = FALSE;
+    }
+
+  /* Requests already queued are run before the worker exits */
+  if (ct->worker)
+    CardTerminal_StopWorker (ct);
+#endif
+}
+
 char
 CardTerminal_Close (CardTerminal * ct)
 {
@@ -224,6 +540,8 @@ CardTerminal_Close (CardTerminal * ct)
 
   ret = OK;
 
+  CardTerminal_Drain (ct);
+
   for (i = 0; i < ct->num_slots; i++)
     {
       if (ct->slots[i] != NULL)
@@ -248,6 +566,7 @@ CardTerminal_Close (CardTerminal * ct)
 
 #ifdef HAVE_PTHREAD_H
   pthread_mutex_destroy(&(ct->mutex));
+  pthread_cond_destroy(&(ct->cond));
 #endif
   return ret;
 }
@@ -267,13 +586,46 @@ CardTerminal_GetSlot (CardTerminal * ct, int number)
   return NULL;
 }
 
-#ifdef HAVE_PTHREAD_H
-pthread_mutex_t *
-CardTerminal_GetMutex (CardTerminal * ct)
+bool
+CardTerminal_GetCard (CardTerminal * ct, int number, bool * card)
 {
-  return &(ct->mutex);
+  int cached;
+
+  if ((number < 0) || (number >= CARDTERMINAL_MAX_SLOTS))
+    return FALSE;
+
+  /* Written only with the turn, a stale value is fine for a poll */
+  cached = ct->cards[number];
+
+  if (cached < 0)
+    return FALSE;
+
+  (*card) = (cached != 0);
+  return TRUE;
+}
+
+char
+CardTerminal_CheckSlot (CardTerminal * ct, int number, bool * card, bool * change)
+{
+  char ret;
+
+  if ((number < 0) || (number >= ct->num_slots))
+    return ERR_INVALID;
+
+  ret = CT_Slot_Check (ct->slots[number], 0, card, change);
+
+  if (ret != OK)
+    return ret;
+
+  ct->cards[number] = (*card) ? 1 : 0;
+
+  /* Resynchronise the driver status with the actual status of slot */
+  if ((CT_Slot_GetICCType (ct->slots[number]) != CT_SLOT_NULL) && 
+      (!(*card) || (*change)))
+    ret = CT_Slot_Release (ct->slots[number]);
+
+  return ret;
 }
-#endif
 
 /* 
  * Not exported functions definition
@@ -681,6 +1033,7 @@ static char
 CardTerminal_GetStatus (CardTerminal * ct, APDU_Cmd * cmd, APDU_Rsp ** rsp)
 {
   BYTE buffer[CARDTERMINAL_GETSTATUS_BUFFER_SIZE], p1, p2;
+  IO_Serial_Stats *stats;
   bool card, change;
   int i;
   unsigned length;
@@ -724,7 +1077,7 @@ CardTerminal_GetStatus (CardTerminal * ct, APDU_Cmd * cmd, APDU_Rsp ** rsp)
     {
       for (i = 0; i < ct->num_slots; i++)
 	{
-	  ret = CT_Slot_Check (ct->slots[i], 0, &card, &change);
+	  ret = CardTerminal_CheckSlot (ct, i, &card, &change);
 	  
 	  if (ret != OK)
 	    {
@@ -733,19 +1086,6 @@ CardTerminal_GetStatus (CardTerminal * ct, APDU_Cmd * cmd, APDU_Rsp ** rsp)
 	      return ret;
 	    }
 
-	  /* Resynchronise the driver status with the actual status of slot */
-	  if ((CT_Slot_GetICCType (ct->slots[i]) != CT_SLOT_NULL) && 
-	      (!card || change))
-	    {
-	      ret = CT_Slot_Release (ct->slots[i]);
-
-	      if (ret != OK)
-	        {
-		  (*rsp) = NULL;
-		  return ret;
-		}
-	    }
-
 	  buffer[i] = card? CTBCS_DATA_STATUS_CARD_CONNECT: CTBCS_DATA_STATUS_NOCARD;
 	}
       
@@ -753,6 +1093,28 @@ CardTerminal_GetStatus (CardTerminal * ct, APDU_Cmd * cmd, APDU_Rsp ** rsp)
       buffer[i] = CTBCS_SW1_OK;
       buffer[i+1] = CTBCS_SW2_OK;
     }
+
+  else if (p2 >= CTBCS_P2_STATUS_COUNTERS && p2 <= CTBCS_P2_STATUS_CT_COMMAND)
+    {
+      stats = IO_Serial_GetStats (ct->io);
+
+      if (p2 == CTBCS_P2_STATUS_COUNTERS)
+	length = CardTerminal_PutCounters (buffer, stats, &(ct->stats));
+      else if (p2 == CTBCS_P2_STATUS_IO_READ)
+	length = CardTerminal_PutHistogram (buffer, &(stats->io_read));
+      else if (p2 == CTBCS_P2_STATUS_ICC_RECEIVE)
+	length = CardTerminal_PutHistogram (buffer, &(stats->icc_receive));
+      else if (p2 == CTBCS_P2_STATUS_PROTOCOL)
+	length = CardTerminal_PutHistogram (buffer, &(stats->protocol_command));
+      else if (p2 == CTBCS_P2_STATUS_CT_LOCK)
+	length = CardTerminal_PutHistogram (buffer, &(ct->stats.lock));
+      else
+	length = CardTerminal_PutHistogram (buffer, &(ct->stats.command));
+
+      buffer[length++] = CTBCS_SW1_OK;
+      buffer[length++] = CTBCS_SW2_OK;
+      ret = OK;
+    }
   
   /* Wrong command cualifier */
   else 
@@ -882,7 +1244,505 @@ CardTerminal_Clear (CardTerminal * ct)
 
   ct->io = NULL;
   ct->num_slots = 0;
+  ct->reopens = 0;
+  memset (&(ct->stats), 0, sizeof (CardTerminal_Stats));
 
   for (i = 0; i < CARDTERMINAL_MAX_SLOTS; i++)
-    ct->slots[i] = NULL;
+    {
+      ct->slots[i] = NULL;
+      ct->cards[i] = -1;
+    }
+
+#ifdef HAVE_PTHREAD_H
+  ct->busy = FALSE;
+  ct->owned = FALSE;
+  ct->expires.tv_sec = 0;
+  ct->expires.tv_nsec = 0;
+  ct->worker = FALSE;
+
+  for (i = 0; i < CARDTERMINAL_PRIORITIES; i++)
+    {
+      ct->pending[i] = 0;
+      ct->tickets[i] = 0;
+      ct->served[i] = 0;
+      ct->queues[i].stub.next = NULL;
+      ct->queues[i].head = &(ct->queues[i].stub);
+      ct->queues[i].tail = &(ct->queues[i].stub);
+    }
+
+  ct->queued = 0;
+  ct->stopping = FALSE;
+  ct->failures = 0;
+  ct->tripped = FALSE;
+  ct->probing = FALSE;
+  ct->probed = FALSE;
+#endif
+}
+
+static unsigned
+CardTerminal_PutCounter (BYTE * buffer, unsigned long counter)
+{
+  /* Big endian, wrapping at 32 bits */
+  buffer[0] = (BYTE) (counter >> 24);
+  buffer[1] = (BYTE) (counter >> 16);
+  buffer[2] = (BYTE) (counter >> 8);
+  buffer[3] = (BYTE) counter;
+
+  return 4;
+}
+
+static unsigned
+CardTerminal_PutCounters (BYTE * buffer, IO_Serial_Stats * stats, CardTerminal_Stats * ct_stats)
+{
+  /* Order is part of the GET STATUS interface, append new counters only */
+  unsigned long counters[CARDTERMINAL_STATUS_COUNTERS] =
+    {
+      stats->io_reads,
+      stats->io_writes,
+      stats->io_bytes_in,
+      stats->io_bytes_out,
+      stats->io_timeouts,
+      stats->io_errors,
+      stats->ifd_commands,
+      stats->ifd_baudrates,
+      stats->ifd_parities,
+      stats->icc_resets,
+      stats->icc_transmits,
+      stats->icc_receives,
+      stats->t0_tpdus,
+      stats->t0_nulls,
+      stats->t0_get_responses,
+      stats->t1_blocks_out,
+      stats->t1_blocks_in,
+      stats->t1_wtx,
+      stats->t1_errors,
+      ct_stats->commands,
+      ct_stats->errors,
+      ct_stats->trips,
+      ct_stats->rejected,
+      stats->io_reopens,
+      stats->icc_skipped
+    };
+  unsigned length = 0;
+  int i;
+
+  /* Never more than CARDTERMINAL_STATUS_COUNTERS, whatever the list above */
+  for (i = 0; i < CARDTERMINAL_STATUS_COUNTERS; i++)
+    length += CardTerminal_PutCounter (buffer + length, counters[i]);
+
+  return length;
+}
+
+/* Bring the reader and the slots back after the serial device was reopened */
+static bool
+CardTerminal_Reconnect (CardTerminal * ct)
+{
+  bool reset, card, change;
+  int i;
+
+  /* The reader may have lost the parity of any slot, not only the first */
+  for (i = 0; i < ct->num_slots; i++)
+    IFD_Towitoko_ForgetParity (ct->slots[i]->ifd);
+
+  if (IFD_Towitoko_Restore (ct->slots[0]->ifd, &reset) != IFD_TOWITOKO_OK)
+    return FALSE;
+
+  ct->reopens = ct->io->stats.io_reopens;
+
+  /* A card still powered keeps its session, unless the reader saw it replaced */
+  for (i = 0; i < ct->num_slots; i++)
+    {
+      if (CT_Slot_GetICC (ct->slots[i]) == NULL)
+	continue;
+
+      if (reset || (CT_Slot_Check (ct->slots[i], 0, &card, &change) != OK) || !card || change)
+	CT_Slot_Release (ct->slots[i]);
+    }
+
+  return TRUE;
+}
+
+static unsigned
+CardTerminal_PutHistogram (BYTE * buffer, IO_Serial_Histogram * hist)
+{
+  unsigned length = 0;
+  int i;
+
+  /* Count, total in milliseconds, maximum and buckets in microseconds */
+  length += CardTerminal_PutCounter (buffer + length, hist->count);
+  length += CardTerminal_PutCounter (buffer + length, hist->total / 1000);
+  length += CardTerminal_PutCounter (buffer + length, hist->max);
+
+  for (i = 0; i < IO_SERIAL_STATS_BUCKETS; i++)
+    length += CardTerminal_PutCounter (buffer + length, hist->buckets[i]);
+
+  return length;
+}
+
+#ifdef HAVE_PTHREAD_H
+static bool
+CardTerminal_StartWorker (CardTerminal * ct, unsigned short pn)
+{
+#ifdef OS_LINUX
+  cpu_set_t cpus;
+  char *env, *end;
+  long cpu, online;
+
+  /* A CPU number pins the worker of each port to its own CPU from there */
+  env = getenv (CARDTERMINAL_WORKER_ENV);
+  cpu = strtol (env, &end, 10);
+  online = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+  if (pthread_create (&(ct->thread), NULL, CardTerminal_Worker, ct) != 0)
+    return FALSE;
+
+#ifdef OS_LINUX
+  if ((end != env) && (*end == '\0') && (cpu >= 0) && (online > 0))
+    {
+      CPU_ZERO (&cpus);
+      CPU_SET ((cpu + pn) % online, &cpus);
+      pthread_setaffinity_np (ct->thread, sizeof (cpus), &cpus);
+    }
+#endif
+
+  return TRUE;
+}
+
+static void
+CardTerminal_StopWorker (CardTerminal * ct)
+{
+  CardTerminal_Execute (ct, CARDTERMINAL_PRIORITY_LOW, CardTerminal_Stop, ct);
+  pthread_join (ct->thread, NULL);
+
+  ct->worker = FALSE;
+}
+
+static void
+CardTerminal_Stop (void * arg)
+{
+  ((CardTerminal *) arg)->stopping = TRUE;
+}
+
+static void *
+CardTerminal_Worker (void * arg)
+{
+  CardTerminal *ct = (CardTerminal *) arg;
+  CardTerminal_Request *request;
+  int queued, priority;
+
+  while (!ct->stopping)
+    {
+      /* Idle while the owner of a transaction runs its own requests */
+      if (ct->owned)
+	{
+	  pthread_mutex_lock (&(ct->mutex));
+
+	  while (CardTerminal_IsHeld (ct))
+	    CardTerminal_WaitTurn (ct);
+
+	  pthread_mutex_unlock (&(ct->mutex));
+	}
+
+      /* Read before the queues, so a push after the pop changes it */
+      queued = ct->queued;
+      request = NULL;
+
+      /* Higher priority classes are emptied first */
+      for (priority = 0; (priority < CARDTERMINAL_PRIORITIES) && (request == NULL); priority++)
+	request = CardTerminal_Pop (&(ct->queues[priority]));
+
+      if (request == NULL)
+	{
+	  CardTerminal_Wait (&(ct->queued), queued);
+	  continue;
+	}
+
+      __sync_fetch_and_sub (&(ct->pending[priority - 1]), 1);
+
+      request->run (request->arg);
+
+      /* The request lives in the stack of the caller, not used after this */
+      __sync_synchronize ();
+      request->done = 1;
+      CardTerminal_Wake (&(request->done));
+    }
+
+  return NULL;
+}
+
+/* Says if requests of a higher priority class are waiting */
+static bool
+CardTerminal_IsPreempted (CardTerminal * ct, int priority)
+{
+  int i;
+
+  for (i = 0; i < priority; i++)
+    if (ct->pending[i] > 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Says if the calling thread holds a transaction, called with the mutex */
+static bool
+CardTerminal_IsOwner (CardTerminal * ct)
+{
+  return ct->owned && pthread_equal (ct->owner, pthread_self ());
+}
+
+/* Says if a transaction holds the card-terminal, and ends it if timed out */
+static bool
+CardTerminal_IsHeld (CardTerminal * ct)
+{
+  if (!ct->owned)
+    return FALSE;
+
+  /* Never timed out in the middle of a command of the owner */
+  if (ct->busy || ((ct->expires.tv_sec == 0) && (ct->expires.tv_nsec == 0)))
+    return TRUE;
+
+  if (!CardTerminal_IsPast (&(ct->expires)))
+    return TRUE;
+
+  ct->owned = FALSE;
+  return FALSE;
+}
+
+/* Wait for a change in the turn, or the end of the transaction holding it */
+static void
+CardTerminal_WaitTurn (CardTerminal * ct)
+{
+  if (!ct->owned || ct->busy || ((ct->expires.tv_sec == 0) && (ct->expires.tv_nsec == 0)))
+    pthread_cond_wait (&(ct->cond), &(ct->mutex));
+  else
+    CardTerminal_WaitUntil (ct, &(ct->expires));
+}
+
+/* Says if a time taken from IO_Serial_GetTime has been reached */
+static bool
+CardTerminal_IsPast (struct timespec * time)
+{
+  struct timespec now;
+
+  IO_Serial_GetTime (&now);
+
+  return (now.tv_sec > time->tv_sec) ||
+    ((now.tv_sec == time->tv_sec) && (now.tv_nsec >= time->tv_nsec));
+}
+
+/* Wait for a change in the card-terminal, at most until a time of IO_Serial_GetTime */
+static void
+CardTerminal_WaitUntil (CardTerminal * ct, struct timespec * time)
+{
+  struct timespec now, until;
+#ifdef HAVE_SYS_TIME_H
+  struct timeval tv;
+#endif
+  long remain;
+
+  /* The time is on the clock of IO_Serial_GetTime, the wait on the real time one */
+  IO_Serial_GetTime (&now);
+  remain = (time->tv_sec - now.tv_sec) * 1000L + (time->tv_nsec - now.tv_nsec) / 1000000L + 1;
+
+  if (remain <= 0)
+    return;
+
+#ifdef HAVE_SYS_TIME_H
+  gettimeofday (&tv, NULL);
+  until.tv_sec = tv.tv_sec + remain / 1000L;
+  until.tv_nsec = tv.tv_usec * 1000L + (remain % 1000L) * 1000000L;
+#else
+  until.tv_sec = time (NULL) + remain / 1000L;
+  until.tv_nsec = (remain % 1000L) * 1000000L;
+#endif
+
+  if (until.tv_nsec >= 1000000000L)
+    {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+
+  pthread_cond_timedwait (&(ct->cond), &(ct->mutex), &until);
+}
+
+static void
+CardTerminal_Hold (void * arg)
+{
+  CardTerminal_Transaction *transaction = (CardTerminal_Transaction *) arg;
+  CardTerminal *ct = transaction->ct;
+
+  pthread_mutex_lock (&(ct->mutex));
+
+  ct->owner = transaction->owner;
+  ct->owned = TRUE;
+
+  if (transaction->timeout > 0)
+    {
+      IO_Serial_GetTime (&(ct->expires));
+      ct->expires.tv_sec += transaction->timeout;
+    }
+  else
+    {
+      ct->expires.tv_sec = 0;
+      ct->expires.tv_nsec = 0;
+    }
+
+  pthread_mutex_unlock (&(ct->mutex));
+}
+
+static void *
+CardTerminal_Prober (void * arg)
+{
+  CardTerminal *ct = (CardTerminal *) arg;
+  struct timespec next;
+
+  pthread_mutex_lock (&(ct->mutex));
+
+  while (ct->tripped)
+    {
+      IO_Serial_GetTime (&next);
+      next.tv_sec += CARDTERMINAL_BREAKER_INTERVAL / 1000;
+      next.tv_nsec += (CARDTERMINAL_BREAKER_INTERVAL % 1000) * 1000000L;
+
+      if (next.tv_nsec >= 1000000000L)
+	{
+	  next.tv_sec++;
+	  next.tv_nsec -= 1000000000L;
+	}
+
+      while (ct->tripped && !CardTerminal_IsPast (&next))
+	CardTerminal_WaitUntil (ct, &next);
+
+      if (!ct->tripped)
+	break;
+
+      /* Behind commands to cards, though none is admitted meanwhile */
+      pthread_mutex_unlock (&(ct->mutex));
+      CardTerminal_Execute (ct, CARDTERMINAL_PRIORITY_LOW, CardTerminal_Probe, ct);
+      pthread_mutex_lock (&(ct->mutex));
+    }
+
+  ct->probing = FALSE;
+  pthread_mutex_unlock (&(ct->mutex));
+
+  return NULL;
+}
+
+static void
+CardTerminal_Probe (void * arg)
+{
+  CardTerminal *ct = (CardTerminal *) arg;
+
+  /* A cancel of the last call must not fail the probe */
+  IO_Serial_ResetCancel (ct->io);
+
+  if (IFD_Towitoko_GetReaderInfo (ct->slots[0]->ifd) != IFD_TOWITOKO_OK)
+    {
+      /* The reader may have come back reset, with the device reopened */
+      if ((ct->reopens == ct->io->stats.io_reopens) || !CardTerminal_Reconnect (ct))
+	return;
+    }
+
+  pthread_mutex_lock (&(ct->mutex));
+  ct->failures = 0;
+  ct->tripped = FALSE;
+  pthread_cond_broadcast (&(ct->cond));
+  pthread_mutex_unlock (&(ct->mutex));
 }
+
+/*
+ * Intrusive multiple producer single consumer queue: producers swap
+ * themselves in as head and link the previous one, the worker follows
+ * the links from tail. Requests of a class are run in the order they
+ * were queued
+ */
+static void
+CardTerminal_Push (CardTerminal_Queue * queue, CardTerminal_Request * request)
+{
+  CardTerminal_Request *prev;
+
+  request->next = NULL;
+  prev = (CardTerminal_Request *) __sync_lock_test_and_set (&(queue->head), request);
+  prev->next = request;
+}
+
+static CardTerminal_Request *
+CardTerminal_Pop (CardTerminal_Queue * queue)
+{
+  CardTerminal_Request *tail, *next;
+
+  tail = queue->tail;
+  next = tail->next;
+
+  /* Skip the stub */
+  if (tail == &(queue->stub))
+    {
+      if (next == NULL)
+	return NULL;
+
+      queue->tail = next;
+      tail = next;
+      next = next->next;
+    }
+
+  if (next != NULL)
+    {
+      queue->tail = next;
+      return tail;
+    }
+
+  /* A producer has swapped the head but not linked it yet */
+  if (tail != queue->head)
+    return NULL;
+
+  /* Last request: put the stub behind it so it can be detached */
+  CardTerminal_Push (queue, &(queue->stub));
+
+  next = tail->next;
+
+  if (next != NULL)
+    {
+      queue->tail = next;
+      return tail;
+    }
+
+  return NULL;
+}
+
+#ifdef OS_LINUX
+static void
+CardTerminal_Wait (volatile int * address, int value)
+{
+  syscall (SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void
+CardTerminal_Wake (volatile int * address)
+{
+  syscall (SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#else
+static pthread_mutex_t cardterminal_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cardterminal_wait_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+CardTerminal_Wait (volatile int * address, int value)
+{
+  pthread_mutex_lock (&cardterminal_wait_mutex);
+
+  while (*address == value)
+    pthread_cond_wait (&cardterminal_wait_cond, &cardterminal_wait_mutex);
+
+  pthread_mutex_unlock (&cardterminal_wait_mutex);
+}
+
+static void
+CardTerminal_Wake (volatile int * address)
+{
+  pthread_mutex_lock (&cardterminal_wait_mutex);
+  pthread_cond_broadcast (&cardterminal_wait_cond);
+  pthread_mutex_unlock (&cardterminal_wait_mutex);
+}
+#endif
+#endif
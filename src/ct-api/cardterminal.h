@@ -40,17 +40,86 @@
 /* Maximum number of slots in a cardterminal */
 #define CARDTERMINAL_MAX_SLOTS		2
 
+/* Priority classes of the requests to a card-terminal */
+#define CARDTERMINAL_PRIORITY_HIGH	0	/* Commands to cards */
+#define CARDTERMINAL_PRIORITY_LOW	1	/* Presence polls and housekeeping */
+#define CARDTERMINAL_PRIORITIES		2
+
+/* Consecutive transmission errors before the reader is probed */
+#ifndef CARDTERMINAL_BREAKER_FAILURES
+#define CARDTERMINAL_BREAKER_FAILURES	3
+#endif
+
+/* Interval (ms) between probes of a reader not answering */
+#ifndef CARDTERMINAL_BREAKER_INTERVAL
+#define CARDTERMINAL_BREAKER_INTERVAL	1000
+#endif
+
 /*
  * Exported datatypes definition 
  */
 
+#ifdef HAVE_PTHREAD_H
+/* Work run with exclusive access to a card-terminal */
+typedef struct CardTerminal_Request
+{
+  struct CardTerminal_Request * volatile next;	/* Next request queued */
+  void (*run) (void * arg);			/* Function to run */
+  void * arg;					/* Argument to the function */
+  volatile int done;				/* Set when run has returned */
+}
+CardTerminal_Request;
+
+/* Requests of one priority class waiting for the worker */
+typedef struct
+{
+  CardTerminal_Request * volatile head;		/* Last request queued */
+  CardTerminal_Request * tail;			/* Next request to run, worker only */
+  CardTerminal_Request stub;			/* Keeps the queue never empty */
+}
+CardTerminal_Queue;
+#endif
+
+/* Counters of the CT-API layer, updated with exclusive access to it */
+typedef struct
+{
+  unsigned long commands;		/* CT_data calls */
+  unsigned long errors;			/* CT_data calls not returning OK */
+  IO_Serial_Histogram lock;		/* Time waiting for the card-terminal lock */
+  IO_Serial_Histogram command;		/* Time taken by CT_data once locked */
+  unsigned long trips;			/* Times the reader stopped answering */
+  unsigned long rejected;		/* Calls failed at once meanwhile, atomic */
+}
+CardTerminal_Stats;
+
 typedef struct
 {
   IO_Serial * io;				/* Serial device */
   CT_Slot * slots[CARDTERMINAL_MAX_SLOTS];	/* Array of CT_Slot's */
   int num_slots;				/* Number of CT_Slot's */
+  volatile int cards[CARDTERMINAL_MAX_SLOTS];	/* Card present at the last check, -1 if none yet */
+  unsigned long reopens;			/* Reopens of the serial device restored */
+  CardTerminal_Stats stats;			/* Counters since the card-terminal was initialized */
 #ifdef HAVE_PTHREAD_H
   pthread_mutex_t mutex;
+  pthread_cond_t cond;				/* Signaled when busy is cleared */
+  bool busy;					/* A request is running out of the worker */
+  volatile bool owned;				/* A transaction holds the card-terminal */
+  pthread_t owner;				/* Thread holding the transaction */
+  struct timespec expires;			/* End of the transaction, zero if none */
+  volatile int pending[CARDTERMINAL_PRIORITIES];	/* Requests waiting per class */
+  unsigned long tickets[CARDTERMINAL_PRIORITIES];	/* Turns given per class */
+  unsigned long served[CARDTERMINAL_PRIORITIES];	/* Turns taken per class */
+  bool worker;					/* Requests are run by a worker thread */
+  pthread_t thread;				/* Worker driving the serial device */
+  CardTerminal_Queue queues[CARDTERMINAL_PRIORITIES];	/* Queued per class */
+  volatile int queued;				/* Requests queued, wakes the worker */
+  bool stopping;				/* Worker exits after this request */
+  int failures;					/* Consecutive transmission errors */
+  volatile bool tripped;			/* Reader not answering, calls fail at once */
+  bool probing;					/* The prober thread is running */
+  bool probed;					/* The prober thread is to be joined */
+  pthread_t prober;				/* Thread probing a tripped reader */
 #endif
 }
 CardTerminal;
@@ -67,14 +136,50 @@ CardTerminal_New ();
 extern char 
 CardTerminal_Init (CardTerminal * ct, unsigned short pn);
 
+/* End the transaction of a CardTerminal, run the requests queued and stop its threads */
+extern void
+CardTerminal_Drain (CardTerminal * ct);
+
+/* Run a function with exclusive access to a CardTerminal */
+extern void
+CardTerminal_Execute (CardTerminal * ct, int priority, void (*run) (void *), void * arg);
+
+/* Hold a CardTerminal for the calling thread, timeout in seconds or 0 */
+extern char
+CardTerminal_BeginTransaction (CardTerminal * ct, unsigned timeout);
+
+/* Release a CardTerminal held by the calling thread */
+extern char
+CardTerminal_EndTransaction (CardTerminal * ct);
+
+/* Number of requests of a priority class waiting for a CardTerminal */
+extern int
+CardTerminal_GetPending (CardTerminal * ct, int priority);
+
+/* Says if a call may use a CardTerminal, FALSE while its reader is not answering */
+extern bool
+CardTerminal_Admit (CardTerminal * ct);
+
+/* Account the result of a call, with exclusive access to a CardTerminal */
+extern void
+CardTerminal_Report (CardTerminal * ct, char ret);
+
 /* Send a CT-BCS command to a CardTerminal */
 extern char
 CardTerminal_Command (CardTerminal * ct, APDU_Cmd * cmd, APDU_Rsp ** rsp);
 
+/* Card presence seen by the last check of a slot, without asking the reader */
+extern bool
+CardTerminal_GetCard (CardTerminal * ct, int number, bool * card);
+
 /* Return the reference to a slot */
 extern CT_Slot *
 CardTerminal_GetSlot (CardTerminal * ct, int number);
 
+/* Check presence of ICC in a slot and whether it changed since last check */
+extern char
+CardTerminal_CheckSlot (CardTerminal * ct, int number, bool * card, bool * change);
+
 /* Close a CardTerminal */
 extern char
 CardTerminal_Close (CardTerminal * cn);
@@ -83,9 +188,4 @@ CardTerminal_Close (CardTerminal * cn);
 extern void 
 CardTerminal_Delete (CardTerminal * ct);
 
-#ifdef HAVE_PTHREAD_H
-extern pthread_mutex_t *
-CardTerminal_GetMutex (CardTerminal * ct);
-#endif
-
 #endif
@@ -37,6 +37,11 @@
 #include <sys/time.h>
 #endif
 
+/* Interval (ms) between status polls while waiting for a card */
+#ifndef CT_SLOT_CHECK_INTERVAL
+#define CT_SLOT_CHECK_INTERVAL	100
+#endif
+
 /* Try first asynchronous init and if it fails try synchronous */
 #undef ICC_PROBE_ASYNC_FIRST
 
@@ -86,11 +91,11 @@ char
 CT_Slot_Check (CT_Slot * slot, int timeout, bool * card, bool * change)
 {
   BYTE status;
-#ifdef HAVE_NANOSLEEP
-  struct timespec req_ts;
+  unsigned long elapsed, delay, limit;
+#ifdef HAVE_SYS_TIME_H
+  struct timeval start, now;
 
-  req_ts.tv_sec = 1;
-  req_ts.tv_nsec = 0;
+  gettimeofday (&start, NULL);
 #endif
 
   /* Do first time check */
@@ -99,21 +104,33 @@ CT_Slot_Check (CT_Slot * slot, int timeout, bool * card, bool * change)
 
   (*change) = IFD_TOWITOKO_CHANGE (status);
 
-  while ((timeout > 0) && (!IFD_TOWITOKO_CARD (status)))
+  if (status == IFD_TOWITOKO_CARD_CHANGE)
+    slot->stats.insertions++;
+
+  /* Timeout is given in seconds */
+  limit = (timeout > 0) ? timeout * 1000L : 0;
+  elapsed = 0;
+
+  while ((elapsed < limit) && (!IFD_TOWITOKO_CARD (status)))
     {
-      timeout --;
+      delay = MIN (limit - elapsed, CT_SLOT_CHECK_INTERVAL);
 
-#ifdef HAVE_NANOSLEEP
-      /* Sleep one second */
-      nanosleep (&req_ts,NULL);
-#else
-      usleep (1000);
-#endif
+      IFD_Towitoko_WaitStatus (slot->ifd, delay);
 
       if (IFD_Towitoko_GetStatus (slot->ifd, &status) != IFD_TOWITOKO_OK)
 	return ERR_TRANS;
   
       (*change) |= IFD_TOWITOKO_CHANGE (status);
+
+      if (status == IFD_TOWITOKO_CARD_CHANGE)
+	slot->stats.insertions++;
+
+#ifdef HAVE_SYS_TIME_H
+      gettimeofday (&now, NULL);
+      elapsed = (now.tv_sec - start.tv_sec) * 1000L + (now.tv_usec - start.tv_usec) / 1000L;
+#else
+      elapsed += delay;
+#endif
     }
   
   (*card) = IFD_TOWITOKO_CARD (status);
@@ -127,6 +144,9 @@ CT_Slot_Probe (CT_Slot * slot, BYTE * userdata, unsigned length)
   PPS * pps;
   BYTE buffer[PPS_MAX_LENGTH];
   unsigned buffer_len  = 0;
+
+  slot->stats.probes++;
+  slot->stats.baudrate = 0;
   
 #ifndef ICC_PROBE_ASYNC_FIRST
 
@@ -153,6 +173,7 @@ CT_Slot_Probe (CT_Slot * slot, BYTE * userdata, unsigned length)
 	  /* ICC is not synchronous neither asynchronous */
 	  slot->icc = NULL;
 	  slot->icc_type = CT_SLOT_NULL;
+	  slot->stats.probe_errors++;
 
 	  /* return ERR_TRANS */
 	  return OK;
@@ -191,6 +212,7 @@ CT_Slot_Probe (CT_Slot * slot, BYTE * userdata, unsigned length)
 	  /* ICC is not synchronous neither asynchronous */
 	  slot->icc = NULL;
 	  slot->icc_type = CT_SLOT_NULL;
+	  slot->stats.probe_errors++;
 
 	  return OK;
 	}
@@ -235,12 +257,14 @@ CT_Slot_Probe (CT_Slot * slot, BYTE * userdata, unsigned length)
 	  slot->icc = NULL;
 	  slot->icc_type = CT_SLOT_NULL;
 	  slot->protocol_type = CT_SLOT_NULL;
+	  slot->stats.probe_errors++;
 
 	  return ERR_TRANS;
 	}
       
       slot->protocol_type = (PPS_GetProtocolParameters (pps))->t;
       slot->protocol = PPS_GetProtocol (pps);
+      ICC_Async_GetBaudrate ((ICC_Async *) slot->icc, &(slot->stats.baudrate));
       
       PPS_Delete (pps);
     }
@@ -275,6 +299,7 @@ CT_Slot_Probe (CT_Slot * slot, BYTE * userdata, unsigned length)
 
 	  slot->protocol = NULL;
 	  slot->protocol_type = CT_SLOT_NULL;
+	  slot->stats.probe_errors++;
 
 	  return ERR_TRANS;
 	}
@@ -318,6 +343,7 @@ CT_Slot_Release (CT_Slot * slot)
 
   slot->protocol = NULL;
   slot->protocol_type = CT_SLOT_NULL;
+  slot->stats.baudrate = 0;
 
   if (slot->icc_type == CT_SLOT_ICC_SYNC)
     {
@@ -345,8 +371,11 @@ char
 CT_Slot_Command (CT_Slot * slot, APDU_Cmd * cmd, APDU_Rsp ** rsp)
 {
   BYTE buffer[2];
+  struct timespec start;
   char ret;
 
+  IO_Serial_GetTime (&start);
+
   /* Synchronous protocol ICC */
   if (slot->protocol_type == CT_SLOT_PROTOCOL_SYNC)
     {
@@ -391,6 +420,9 @@ CT_Slot_Command (CT_Slot * slot, APDU_Cmd * cmd, APDU_Rsp ** rsp)
       ret = ERR_HTSI;
     }
 
+  if (slot->protocol_type != CT_SLOT_NULL)
+    IO_Serial_AddLatency (&(IO_Serial_GetStats (slot->ifd->io)->protocol_command), &start);
+
   return ret;
 }
 
@@ -509,4 +541,5 @@ CT_Slot_Clear (CT_Slot * slot)
   slot->protocol = NULL;
   slot->icc_type = CT_SLOT_NULL;
   slot->protocol_type = CT_SLOT_NULL;
+  memset (&(slot->stats), 0, sizeof (CT_Slot_Stats));
 }
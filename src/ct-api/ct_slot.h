@@ -45,6 +45,16 @@
  * Exported datatypes definition 
  */
 
+/* Counters of a slot, read without locking by the statistics exporter */
+typedef struct
+{
+  unsigned long insertions;	/* Cards inserted */
+  unsigned long probes;		/* Cards reset and probed */
+  unsigned long probe_errors;	/* Probes that failed */
+  unsigned long baudrate;	/* Baudrate of the ICC, 0 if unknown */
+}
+CT_Slot_Stats;
+
 typedef struct
 {
   IFD * ifd;		/* Interface device */
@@ -52,6 +62,7 @@ typedef struct
   void * protocol;	/* Protocol handler */
   int icc_type;		/* Type of ICC */
   int protocol_type;	/* Type of protocol */
+  CT_Slot_Stats stats;	/* Counters of this slot */
 }
 CT_Slot;
 
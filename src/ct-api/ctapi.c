@@ -27,9 +27,99 @@
 #include "cardterminal.h"
 #include "ct_slot.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef HAVE_POLL
+#include <sys/poll.h>
+#else
+#include <sys/time.h>
+#endif
+#endif
+
+/*
+ * Not exported constants definition
+ */
+
+#ifdef HAVE_PTHREAD_H
+/* Environment variable naming the socket of the statistics exporter */
+#define CTAPI_STATS_ENV		"TOWITOKO_STATS_SOCKET"
+
+/* Pending connections to the statistics socket */
+#define CTAPI_STATS_BACKLOG	5
+
+/* Output buffered before each send to a statistics client */
+#define CTAPI_STATS_BUFFER_SIZE	4096
+
+/* Max time (s) a statistics client can take to read */
+#define CTAPI_STATS_TIMEOUT	1
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL		0
+#endif
+#endif
+
+/*
+ * Not exported datatypes definition
+ */
+
+/* Work done with exclusive access to a card-terminal, and its result */
+typedef struct
+{
+  CardTerminal * ct;
+  CT_Slot * slot;
+  unsigned short sn;
+  unsigned char * dad;
+  unsigned char * sad;
+  APDU_Cmd * cmd;
+  APDU_Rsp * rsp;
+  bool card;
+  bool change;
+  unsigned char enable;
+  char * filename;
+  struct timespec start;		/* Time the request was made */
+  char ret;
+}
+CTAPI_Request;
+
+/* Serial device of a card-terminal, as found by CT_cancel */
+typedef struct CTAPI_Cancel
+{
+  unsigned short ctn;
+  IO_Serial * io;
+  struct CTAPI_Cancel * next;
+}
+CTAPI_Cancel;
+
+#ifdef HAVE_PTHREAD_H
+/* Counters of a card-terminal copied by the statistics exporter */
+typedef struct
+{
+  unsigned short ctn;
+  unsigned com;
+  int num_slots;
+  IO_Serial_Stats io;
+  CardTerminal_Stats ct;
+  CT_Slot_Stats slots[CARDTERMINAL_MAX_SLOTS];
+  int protocols[CARDTERMINAL_MAX_SLOTS];
+}
+CTAPI_Stats_Snapshot;
+
+/* Statistics client connection */
+typedef struct
+{
+  int fd;
+  bool failed;
+  unsigned length;
+  char buffer[CTAPI_STATS_BUFFER_SIZE];
+}
+CTAPI_Stats_Output;
 #endif
 
 /* 
@@ -39,8 +129,47 @@
 /* Linked list of card-terminals */
 static CT_List *ct_list = NULL;
 
+/* Kept apart from ct_list, whose lock is held while a card-terminal opens or closes */
+static CTAPI_Cancel *cancel_list = NULL;
+
 #ifdef HAVE_PTHREAD_H
 static pthread_mutex_t ct_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cancel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics exporter, started with the first card-terminal */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t stats_thread;
+static bool stats_running = FALSE;
+static int stats_socket = -1;
+static int stats_pipe[2] = { -1, -1 };
+static char stats_path[sizeof (((struct sockaddr_un *) NULL)->sun_path)];
+#endif
+
+/*
+ * Not exported functions declaration
+ */
+
+static void CTAPI_Data (void *arg);
+static void CTAPI_SlotData (void *arg);
+static void CTAPI_Check (void *arg);
+static void CTAPI_Trace (void *arg);
+static void CTAPI_TraceDump (void *arg);
+static int CTAPI_Priority (unsigned char dad, APDU_Cmd * cmd);
+static void CTAPI_StartCancel (CTAPI_Request * request);
+static void CTAPI_EndCancel (CTAPI_Request * request);
+static bool CTAPI_Coalesce (CTAPI_Request * request);
+static char CTAPI_CopyResponse (APDU_Rsp * apdu_rsp, unsigned long *lr, unsigned char *rsp);
+static bool CTAPI_AddCancel (unsigned short ctn, IO_Serial * io);
+static void CTAPI_RemoveCancel (unsigned short ctn);
+
+#ifdef HAVE_PTHREAD_H
+static void CTAPI_Stats_Start (void);
+static void CTAPI_Stats_Stop (void);
+static void *CTAPI_Stats_Run (void *arg);
+static void CTAPI_Stats_Write (int fd);
+static void CTAPI_Stats_Print (CTAPI_Stats_Output * out, const char *format, ...);
+static void CTAPI_Stats_Flush (CTAPI_Stats_Output * out);
+static void CTAPI_Stats_PrintHistogram (CTAPI_Stats_Output * out, CTAPI_Stats_Snapshot * snap, const char *layer, IO_Serial_Histogram * hist);
 #endif
 
 /*
@@ -78,9 +207,10 @@ CT_init (unsigned short ctn, unsigned short pn)
               if (ct_list_empty)
                 ct_list = CT_List_New ();
 
-              /* Add the CardTerminal to the list */
-              if (!CT_List_AddCardTerminal (ct_list, ct, ctn))
+              /* Add the CardTerminal to the list and let CT_cancel find it */
+              if (!CTAPI_AddCancel (ctn, ct->io) || !CT_List_AddCardTerminal (ct_list, ct, ctn))
                 {
+                  CTAPI_RemoveCancel (ctn);
                   CardTerminal_Close (ct);
                   CardTerminal_Delete (ct);
                   
@@ -105,6 +235,9 @@ CT_init (unsigned short ctn, unsigned short pn)
 
 #ifdef HAVE_PTHREAD_H
   pthread_mutex_unlock (&ct_list_mutex);
+
+  if (ret == OK)
+    CTAPI_Stats_Start ();
 #endif  
 
 #ifdef DEBUG_CTAPI
@@ -129,6 +262,10 @@ CT_close (unsigned short ctn)
 
   if (ct != NULL)
     {    
+      /* Commands still queued can be cancelled until they have run */
+      CardTerminal_Drain (ct);
+      CTAPI_RemoveCancel (ctn);
+
       /* Close CardTerminal */
       ret = CardTerminal_Close(ct);
   
@@ -148,6 +285,8 @@ CT_close (unsigned short ctn)
 
 #ifdef HAVE_PTHREAD_H
   pthread_mutex_unlock (&ct_list_mutex);
+
+  CTAPI_Stats_Stop ();
 #endif
 
 #ifdef DEBUG_CTAPI
@@ -163,11 +302,9 @@ CT_data (unsigned short ctn, unsigned char *dad, unsigned char *sad,
 	 unsigned char *rsp)
 {
   CardTerminal *ct;
-  CT_Slot *slot;
+  CTAPI_Request request;
   APDU_Cmd *apdu_cmd;
-  APDU_Rsp *apdu_rsp = NULL;
-  int remain;
-  unsigned char aux;
+  unsigned long length;
   char ret;
 
 #ifdef DEBUG_CTAPI
@@ -193,85 +330,33 @@ CT_data (unsigned short ctn, unsigned char *dad, unsigned char *sad,
   pthread_mutex_unlock (&ct_list_mutex);
 #endif
 
-  if (ct != NULL)
+  /* Fails at once while the reader is not answering */
+  if ((ct != NULL) && CardTerminal_Admit (ct))
     {
       /* Create a command APDU */
       apdu_cmd = APDU_Cmd_New (cmd, lc);
 
       if (apdu_cmd != NULL)
         {
+          /* Runs in this thread or the worker of the card-terminal */
+          request.ct = ct;
+          request.dad = dad;
+          request.sad = sad;
+          request.cmd = apdu_cmd;
+          request.rsp = NULL;
+          IO_Serial_GetTime (&(request.start));
 
-#ifdef HAVE_PTHREAD_H
-          pthread_mutex_lock (CardTerminal_GetMutex(ct));
-#endif
-
-          /* Command goes to the reader */
-          if ((*dad) == 1)
-            {
-              /* CT-BCS command */
-              ret = CardTerminal_Command (ct, apdu_cmd, &apdu_rsp);
-
-              (*sad) = 1;
-              (*dad) = (*sad);
-            }
-
-          /* Command goes to an ICC */
-          else 
-            {
-              /* Get the slot */
-              slot = CardTerminal_GetSlot(ct, ((*dad)==0)? 0: (*dad)-1);
-
-              if (slot != NULL)
-                {
-                  /* ICC command */
-                  ret = CT_Slot_Command (slot, apdu_cmd, &apdu_rsp);
-        
-                  if (CT_Slot_GetICCType (slot) != CT_SLOT_NULL)
-                    {
-                      aux = (*sad);
-                      (*sad) = (*dad);
-                      (*dad) = aux;
-	            }
-                  else
-	            {
-	              (*dad) = (*sad);
-	              (*sad) = 1;
-	            }
-                }
-      
-              else
-                {
-                  /* Invalid DAD address */
-                  (*dad) = (*sad);
-                  (*sad) = 1;
-                  apdu_rsp = NULL;
-
-                  ret = ERR_INVALID;
-                }
-            }
-
-#ifdef HAVE_PTHREAD_H
-          pthread_mutex_unlock (CardTerminal_GetMutex(ct));
-#endif
-
-          if (apdu_rsp != NULL)
-            {
-              /* Copy APDU data to rsp */
-              remain = MAX ((short)APDU_Rsp_RawLen(apdu_rsp) - (*lr),0);
+          CardTerminal_Execute (ct, CTAPI_Priority (*dad, apdu_cmd), CTAPI_Data, &request);
 
-              if (remain > 0)
-	        ret = ERR_MEMORY;
+          ret = request.ret;
 
-              (*lr) = MIN ((*lr), (short)APDU_Rsp_RawLen (apdu_rsp));
-         
-              memcpy (rsp, APDU_Rsp_Raw (apdu_rsp) + remain, (*lr));
+          /* Copy APDU data to rsp, extended responses included */
+          length = (*lr);
 
-              /* Delete response APDU */
-              APDU_Rsp_Delete (apdu_rsp);
-            }
+          if (CTAPI_CopyResponse (request.rsp, &length, rsp) != OK)
+            ret = ERR_MEMORY;
 
-          else 
-            (*lr) = 0;
+          (*lr) = (unsigned short) length;
 
           /* Delete command APDU */
           APDU_Cmd_Delete (apdu_cmd);
@@ -294,3 +379,935 @@ CT_data (unsigned short ctn, unsigned char *dad, unsigned char *sad,
 
   return ret;
 }
+
+char
+CT_check (unsigned short ctn, unsigned short sn, unsigned char *card, 
+	  unsigned char *change)
+{
+  CardTerminal *ct;
+  CTAPI_Request request;
+  char ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&ct_list_mutex);
+#endif
+
+  /* Get card-terminal */
+  ct = CT_List_GetCardTerminal (ct_list, ctn);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&ct_list_mutex);
+#endif
+
+  if ((ct != NULL) && CardTerminal_Admit (ct))
+    {
+      request.ct = ct;
+      request.sn = sn;
+
+      /* Polls do not wait behind commands to cards */
+      if (!CTAPI_Coalesce (&request))
+        CardTerminal_Execute (ct, CARDTERMINAL_PRIORITY_LOW, CTAPI_Check, &request);
+
+      ret = request.ret;
+      (*card) = (ret == OK) && request.card;
+      (*change) = (ret == OK) && request.change;
+    }
+  else
+    {
+      (*card) = (*change) = 0;
+      ret = ERR_CT;
+    }
+
+#ifdef DEBUG_CTAPI
+  printf ("CTAPI: CT_check(ctn=%u, sn=%u, *card=%u, *change=%u)=%d\n", 
+	  ctn, sn, *card, *change, ret);
+#endif
+
+  return ret;
+}
+
+char
+CT_get_slot (unsigned short ctn, unsigned short sn, void **ct, void **slot)
+{
+  CardTerminal *aux;
+  char ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&ct_list_mutex);
+#endif
+
+  /* Get card-terminal */
+  aux = CT_List_GetCardTerminal (ct_list, ctn);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&ct_list_mutex);
+#endif
+
+  (*ct) = aux;
+  (*slot) = NULL;
+
+  /* Slots live as long as the card-terminal, until CT_close */
+  if (aux != NULL)
+    {
+      (*slot) = CardTerminal_GetSlot (aux, sn);
+      ret = ((*slot) != NULL) ? OK : ERR_INVALID;
+    }
+  else
+    ret = ERR_CT;
+
+#ifdef DEBUG_CTAPI
+  printf ("CTAPI: CT_get_slot(ctn=%u, sn=%u)=%d\n", ctn, sn, ret);
+#endif
+
+  return ret;
+}
+
+char
+CT_slot_data (void *ct, void *slot, unsigned long lc, unsigned char *cmd,
+	      unsigned long *lr, unsigned char *rsp)
+{
+  APDU_Cmd apdu_cmd, *aux;
+  CTAPI_Request request;
+  char ret;
+
+  if (!CardTerminal_Admit ((CardTerminal *) ct))
+    return ERR_CT;
+
+  /* The wrapped buffer skips the size check of APDU_Cmd_New */
+  if (lc > APDU_MAX_CMD_SIZE)
+    {
+      (*lr) = 0;
+      return ERR_MEMORY;
+    }
+
+  /* Wrap the caller buffer, unless it is too short for a command header */
+  if (lc >= 4)
+    {
+      apdu_cmd.command = cmd;
+      apdu_cmd.length = lc;
+      aux = &apdu_cmd;
+    }
+  else
+    aux = APDU_Cmd_New (cmd, lc);
+
+  if (aux == NULL)
+    return ERR_MEMORY;
+
+  request.ct = (CardTerminal *) ct;
+  request.slot = (CT_Slot *) slot;
+  request.cmd = aux;
+  request.rsp = NULL;
+
+  CardTerminal_Execute ((CardTerminal *) ct, CARDTERMINAL_PRIORITY_HIGH, CTAPI_SlotData, &request);
+
+  ret = request.ret;
+
+  if (aux != &apdu_cmd)
+    APDU_Cmd_Delete (aux);
+
+  /* Same copy of the response as CT_data */
+  if (CTAPI_CopyResponse (request.rsp, lr, rsp) != OK)
+    ret = ERR_MEMORY;
+
+#ifdef DEBUG_CTAPI
+  printf ("CTAPI: CT_slot_data(lc=%lu, *lr=%lu)=%d\n", lc, *lr, ret);
+#endif
+
+  return ret;
+}
+
+char
+CT_trace (unsigned short ctn, unsigned char enable)
+{
+  CardTerminal *ct;
+  CTAPI_Request request;
+  char ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&ct_list_mutex);
+#endif
+
+  /* Get card-terminal */
+  ct = CT_List_GetCardTerminal (ct_list, ctn);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&ct_list_mutex);
+#endif
+
+  if (ct != NULL)
+    {
+      request.ct = ct;
+      request.enable = enable;
+
+      CardTerminal_Execute (ct, CARDTERMINAL_PRIORITY_LOW, CTAPI_Trace, &request);
+
+      ret = request.ret;
+    }
+  else
+    ret = ERR_CT;
+
+#ifdef DEBUG_CTAPI
+  printf ("CTAPI: CT_trace(ctn=%u, enable=%u)=%d\n", ctn, enable, ret);
+#endif
+
+  return ret;
+}
+
+char
+CT_trace_dump (unsigned short ctn, char *filename)
+{
+  CardTerminal *ct;
+  CTAPI_Request request;
+  char ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&ct_list_mutex);
+#endif
+
+  /* Get card-terminal */
+  ct = CT_List_GetCardTerminal (ct_list, ctn);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&ct_list_mutex);
+#endif
+
+  if (ct != NULL)
+    {
+      request.ct = ct;
+      request.filename = filename;
+
+      CardTerminal_Execute (ct, CARDTERMINAL_PRIORITY_LOW, CTAPI_TraceDump, &request);
+
+      ret = request.ret;
+    }
+  else
+    ret = ERR_CT;
+
+#ifdef DEBUG_CTAPI
+  printf ("CTAPI: CT_trace_dump(ctn=%u, filename=%s)=%d\n", ctn, filename, ret);
+#endif
+
+  return ret;
+}
+
+char
+CT_trace_print (char *filename)
+{
+  return IO_Serial_PrintTrace (filename, stdout) ? OK : ERR_INVALID;
+}
+
+char
+CT_begin_transaction (unsigned short ctn, unsigned short timeout)
+{
+  CardTerminal *ct;
+  char ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&ct_list_mutex);
+#endif
+
+  /* Get card-terminal */
+  ct = CT_List_GetCardTerminal (ct_list, ctn);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&ct_list_mutex);
+#endif
+
+  /* Waits for other transactions and commands already queued */
+  if (ct != NULL)
+    ret = CardTerminal_BeginTransaction (ct, timeout);
+  else
+    ret = ERR_CT;
+
+#ifdef DEBUG_CTAPI
+  printf ("CTAPI: CT_begin_transaction(ctn=%u, timeout=%u)=%d\n", ctn, timeout, ret);
+#endif
+
+  return ret;
+}
+
+char
+CT_end_transaction (unsigned short ctn)
+{
+  CardTerminal *ct;
+  char ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&ct_list_mutex);
+#endif
+
+  /* Get card-terminal */
+  ct = CT_List_GetCardTerminal (ct_list, ctn);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&ct_list_mutex);
+#endif
+
+  /* ERR_INVALID if the transaction timed out before */
+  if (ct != NULL)
+    ret = CardTerminal_EndTransaction (ct);
+  else
+    ret = ERR_CT;
+
+#ifdef DEBUG_CTAPI
+  printf ("CTAPI: CT_end_transaction(ctn=%u)=%d\n", ctn, ret);
+#endif
+
+  return ret;
+}
+
+char
+CT_cancel (unsigned short ctn)
+{
+  CTAPI_Cancel *cancel;
+  char ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&cancel_mutex);
+#endif
+
+  /* Get the serial device of the card-terminal */
+  for (cancel = cancel_list; cancel != NULL; cancel = cancel->next)
+    {
+      if (cancel->ctn == ctn)
+	break;
+    }
+
+  /* Does not wait for the card-terminal, the command running is woken */
+  if (cancel != NULL)
+    {
+      IO_Serial_Cancel (cancel->io);
+      ret = OK;
+    }
+  else
+    ret = ERR_CT;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&cancel_mutex);
+#endif
+
+#ifdef DEBUG_CTAPI
+  printf ("CTAPI: CT_cancel(ctn=%u)=%d\n", ctn, ret);
+#endif
+
+  return ret;
+}
+
+/*
+ * Not exported functions definition
+ */
+
+static void
+CTAPI_Data (void *arg)
+{
+  CTAPI_Request *request = (CTAPI_Request *) arg;
+  CardTerminal_Stats *stats;
+  struct timespec started;
+  CT_Slot *slot;
+  unsigned char aux;
+
+  /* Counters are only updated with exclusive access to the card-terminal */
+  stats = &(request->ct->stats);
+  IO_Serial_GetTime (&started);
+  IO_Serial_AddLatency (&(stats->lock), &(request->start));
+  CTAPI_StartCancel (request);
+
+  /* Command goes to the reader */
+  if (*(request->dad) == 1)
+    {
+      /* CT-BCS command */
+      request->ret = CardTerminal_Command (request->ct, request->cmd, &(request->rsp));
+
+      *(request->sad) = 1;
+      *(request->dad) = *(request->sad);
+    }
+
+  /* Command goes to an ICC */
+  else 
+    {
+      /* Get the slot */
+      slot = CardTerminal_GetSlot (request->ct, (*(request->dad) == 0) ? 0 : *(request->dad) - 1);
+
+      if (slot != NULL)
+        {
+          /* ICC command */
+          request->ret = CT_Slot_Command (slot, request->cmd, &(request->rsp));
+        
+          if (CT_Slot_GetICCType (slot) != CT_SLOT_NULL)
+            {
+              aux = *(request->sad);
+              *(request->sad) = *(request->dad);
+              *(request->dad) = aux;
+            }
+          else
+            {
+              *(request->dad) = *(request->sad);
+              *(request->sad) = 1;
+            }
+        }
+      
+      else
+        {
+          /* Invalid DAD address */
+          *(request->dad) = *(request->sad);
+          *(request->sad) = 1;
+          request->rsp = NULL;
+
+          request->ret = ERR_INVALID;
+        }
+    }
+
+  CTAPI_EndCancel (request);
+  CardTerminal_Report (request->ct, request->ret);
+  stats->commands++;
+
+  if (request->ret != OK)
+    stats->errors++;
+
+  IO_Serial_AddLatency (&(stats->command), &started);
+}
+
+static void
+CTAPI_SlotData (void *arg)
+{
+  CTAPI_Request *request = (CTAPI_Request *) arg;
+
+  CTAPI_StartCancel (request);
+  request->ret = CT_Slot_Command (request->slot, request->cmd, &(request->rsp));
+  CTAPI_EndCancel (request);
+  CardTerminal_Report (request->ct, request->ret);
+}
+
+static void
+CTAPI_Check (void *arg)
+{
+  CTAPI_Request *request = (CTAPI_Request *) arg;
+
+  /* Commands to cards may have been queued while this poll waited */
+  if (!CTAPI_Coalesce (request))
+    {
+      CTAPI_StartCancel (request);
+      request->ret = CardTerminal_CheckSlot (request->ct, request->sn, &(request->card), &(request->change));
+      CTAPI_EndCancel (request);
+      CardTerminal_Report (request->ct, request->ret);
+    }
+}
+
+static void
+CTAPI_Trace (void *arg)
+{
+  CTAPI_Request *request = (CTAPI_Request *) arg;
+
+  request->ret = IO_Serial_SetTrace (request->ct->io, (request->enable != 0)) ? OK : ERR_MEMORY;
+}
+
+static void
+CTAPI_TraceDump (void *arg)
+{
+  CTAPI_Request *request = (CTAPI_Request *) arg;
+
+  request->ret = IO_Serial_DumpTrace (request->ct->io, request->filename) ? OK : ERR_INVALID;
+}
+
+/* Status polls of the reader give way to commands to cards */
+static int
+CTAPI_Priority (unsigned char dad, APDU_Cmd * cmd)
+{
+  if ((dad == 1) && (APDU_Cmd_RawLen (cmd) >= CTBCS_MIN_COMMAND_SIZE) &&
+      (APDU_Cmd_Cla (cmd) == CTBCS_CLA) && (APDU_Cmd_Ins (cmd) == CTBCS_INS_STATUS))
+    return CARDTERMINAL_PRIORITY_LOW;
+
+  return CARDTERMINAL_PRIORITY_HIGH;
+}
+
+/* A cancel only aborts the command it finds running */
+static void
+CTAPI_StartCancel (CTAPI_Request * request)
+{
+  IO_Serial_ResetCancel (request->ct->io);
+}
+
+/* Failures of a cancelled command are reported as such, whatever the layer */
+static void
+CTAPI_EndCancel (CTAPI_Request * request)
+{
+  if ((request->ret != OK) && IO_Serial_IsCancelled (request->ct->io))
+    request->ret = ERR_CANCELLED;
+}
+
+/*
+ * Answer a presence check with the result of the last one while commands
+ * to cards are waiting. The change stays latched in the reader until a
+ * check reaches it, so none is lost
+ */
+static bool
+CTAPI_Coalesce (CTAPI_Request * request)
+{
+  if (CardTerminal_GetPending (request->ct, CARDTERMINAL_PRIORITY_HIGH) == 0)
+    return FALSE;
+
+  /* Physical presence from the last real check, not whether the card was reset */
+  if (!CardTerminal_GetCard (request->ct, request->sn, &(request->card)))
+    return FALSE;
+
+  request->change = FALSE;
+  request->ret = OK;
+
+  return TRUE;
+}
+
+static bool
+CTAPI_AddCancel (unsigned short ctn, IO_Serial * io)
+{
+  CTAPI_Cancel *cancel;
+
+  cancel = (CTAPI_Cancel *) malloc (sizeof (CTAPI_Cancel));
+
+  if (cancel == NULL)
+    return FALSE;
+
+  cancel->ctn = ctn;
+  cancel->io = io;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&cancel_mutex);
+#endif
+
+  cancel->next = cancel_list;
+  cancel_list = cancel;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&cancel_mutex);
+#endif
+
+  return TRUE;
+}
+
+/* Once it returns, CT_cancel no longer uses the serial device */
+static void
+CTAPI_RemoveCancel (unsigned short ctn)
+{
+  CTAPI_Cancel **cancel, *found;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&cancel_mutex);
+#endif
+
+  for (cancel = &cancel_list; (*cancel) != NULL; cancel = &((*cancel)->next))
+    {
+      if ((*cancel)->ctn == ctn)
+	{
+	  found = (*cancel);
+	  (*cancel) = found->next;
+	  free (found);
+	  break;
+	}
+    }
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&cancel_mutex);
+#endif
+}
+
+/* Copy and delete a response, keeping its end when rsp is too short */
+static char
+CTAPI_CopyResponse (APDU_Rsp * apdu_rsp, unsigned long *lr, unsigned char *rsp)
+{
+  unsigned long length, remain;
+
+  if (apdu_rsp == NULL)
+    {
+      (*lr) = 0;
+      return OK;
+    }
+
+  length = APDU_Rsp_RawLen (apdu_rsp);
+  remain = (length > (*lr)) ? length - (*lr) : 0;
+
+  (*lr) = MIN ((*lr), length);
+  memcpy (rsp, APDU_Rsp_Raw (apdu_rsp) + remain, (*lr));
+
+  APDU_Rsp_Delete (apdu_rsp);
+
+  return (remain > 0) ? ERR_MEMORY : OK;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void
+CTAPI_Stats_Start (void)
+{
+  struct sockaddr_un addr;
+  char *env;
+
+  pthread_mutex_lock (&stats_mutex);
+
+  env = getenv (CTAPI_STATS_ENV);
+
+  if (stats_running || (env == NULL) || (strlen (env) == 0) || (strlen (env) >= sizeof (stats_path)))
+    {
+      pthread_mutex_unlock (&stats_mutex);
+      return;
+    }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, env);
+  strcpy (stats_path, env);
+
+  /* Socket left behind by a previous process */
+  unlink (stats_path);
+
+  stats_socket = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  if ((stats_socket >= 0) &&
+      (bind (stats_socket, (struct sockaddr *) &addr, sizeof (addr)) == 0) &&
+      (listen (stats_socket, CTAPI_STATS_BACKLOG) == 0) &&
+      (pipe (stats_pipe) == 0))
+    {
+      if (pthread_create (&stats_thread, NULL, CTAPI_Stats_Run, stats_pipe) == 0)
+	stats_running = TRUE;
+    }
+
+  if (!stats_running)
+    {
+#ifdef DEBUG_CTAPI
+      printf ("CTAPI: Cannot export statistics on %s\n", stats_path);
+#endif
+      if (stats_socket >= 0)
+	close (stats_socket);
+
+      if (stats_pipe[0] >= 0)
+	{
+	  close (stats_pipe[0]);
+	  close (stats_pipe[1]);
+	}
+
+      stats_socket = -1;
+      stats_pipe[0] = stats_pipe[1] = -1;
+    }
+
+  pthread_mutex_unlock (&stats_mutex);
+}
+
+static void
+CTAPI_Stats_Stop (void)
+{
+  bool empty;
+
+  pthread_mutex_lock (&stats_mutex);
+
+  /* A card-terminal may have been initialized since the last one closed */
+  pthread_mutex_lock (&ct_list_mutex);
+  empty = (ct_list == NULL);
+  pthread_mutex_unlock (&ct_list_mutex);
+
+  if (stats_running && empty)
+    {
+      /* Wake the exporter, it never takes stats_mutex */
+      write (stats_pipe[1], "", 1);
+      pthread_join (stats_thread, NULL);
+
+      close (stats_socket);
+      close (stats_pipe[0]);
+      close (stats_pipe[1]);
+      unlink (stats_path);
+
+      stats_socket = -1;
+      stats_pipe[0] = stats_pipe[1] = -1;
+      stats_running = FALSE;
+    }
+
+  pthread_mutex_unlock (&stats_mutex);
+}
+
+static void *
+CTAPI_Stats_Run (void *arg)
+{
+  int *stop = (int *) arg;
+  int client;
+#ifdef HAVE_POLL
+  struct pollfd ufds[2];
+#else
+  fd_set rfds;
+#endif
+  struct timeval tv;
+
+  for (;;)
+    {
+#ifdef HAVE_POLL
+      ufds[0].fd = stats_socket;
+      ufds[0].events = POLLIN;
+      ufds[1].fd = stop[0];
+      ufds[1].events = POLLIN;
+
+      if (poll (ufds, 2, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+
+      if (ufds[1].revents != 0)
+	break;
+
+      if ((ufds[0].revents & POLLIN) == 0)
+	continue;
+#else
+      FD_ZERO (&rfds);
+      FD_SET (stats_socket, &rfds);
+      FD_SET (stop[0], &rfds);
+
+      if (select (MAX (stats_socket, stop[0]) + 1, &rfds, NULL, NULL, NULL) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+
+      if (FD_ISSET (stop[0], &rfds))
+	break;
+
+      if (!FD_ISSET (stats_socket, &rfds))
+	continue;
+#endif
+
+      client = accept (stats_socket, NULL, NULL);
+
+      if (client < 0)
+	continue;
+
+      /* A client that does not read cannot hold the exporter */
+      tv.tv_sec = CTAPI_STATS_TIMEOUT;
+      tv.tv_usec = 0;
+      setsockopt (client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+      CTAPI_Stats_Write (client);
+      close (client);
+    }
+
+  return NULL;
+}
+
+static void
+CTAPI_Stats_Write (int fd)
+{
+  CTAPI_Stats_Snapshot *snaps, *snap;
+  CTAPI_Stats_Output out;
+  struct CT_List_Node *node;
+  CT_Slot *slot;
+  int num_snaps, i, j;
+
+  /* 
+   * Counters are copied holding only the list lock, which CT_data takes
+   * just to look up the card-terminal, so card traffic is never stalled.
+   * They are written by the thread using the card-terminal, a copy may
+   * mix values from before and after a command
+   */
+  pthread_mutex_lock (&ct_list_mutex);
+
+  num_snaps = (ct_list != NULL) ? CT_List_GetNumberOfElements (ct_list) : 0;
+  snaps = (CTAPI_Stats_Snapshot *) calloc (MAX (num_snaps, 1), sizeof (CTAPI_Stats_Snapshot));
+
+  if (snaps == NULL)
+    num_snaps = 0;
+
+  for (i = 0, node = (ct_list != NULL) ? ct_list->first : NULL; (i < num_snaps) && (node != NULL); i++, node = node->next)
+    {
+      snaps[i].ctn = node->ctn;
+      snaps[i].com = IO_Serial_GetCom (node->ct->io);
+      /* Read without the card-terminal lock, so never trusted as an index */
+      snaps[i].num_slots = MIN (node->ct->num_slots, CARDTERMINAL_MAX_SLOTS);
+      memcpy (&(snaps[i].io), IO_Serial_GetStats (node->ct->io), sizeof (IO_Serial_Stats));
+      memcpy (&(snaps[i].ct), &(node->ct->stats), sizeof (CardTerminal_Stats));
+
+      for (j = 0; j < snaps[i].num_slots; j++)
+	{
+	  slot = CardTerminal_GetSlot (node->ct, j);
+	  memcpy (&(snaps[i].slots[j]), &(slot->stats), sizeof (CT_Slot_Stats));
+	  snaps[i].protocols[j] = slot->protocol_type;
+	}
+    }
+
+  num_snaps = i;
+
+  pthread_mutex_unlock (&ct_list_mutex);
+
+  out.fd = fd;
+  out.failed = FALSE;
+  out.length = 0;
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_apdus_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    CTAPI_Stats_Print (&out, "towitoko_apdus_total{ctn=\"%u\",port=\"%u\"} %lu\n", snap->ctn, snap->com, snap->io.protocol_command.count);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_ct_commands_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    CTAPI_Stats_Print (&out, "towitoko_ct_commands_total{ctn=\"%u\",port=\"%u\"} %lu\n", snap->ctn, snap->com, snap->ct.commands);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_ct_errors_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    CTAPI_Stats_Print (&out, "towitoko_ct_errors_total{ctn=\"%u\",port=\"%u\"} %lu\n", snap->ctn, snap->com, snap->ct.errors);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_breaker_trips_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    CTAPI_Stats_Print (&out, "towitoko_breaker_trips_total{ctn=\"%u\",port=\"%u\"} %lu\n", snap->ctn, snap->com, snap->ct.trips);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_breaker_rejected_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    CTAPI_Stats_Print (&out, "towitoko_breaker_rejected_total{ctn=\"%u\",port=\"%u\"} %lu\n", snap->ctn, snap->com, snap->ct.rejected);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_io_reopens_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    CTAPI_Stats_Print (&out, "towitoko_io_reopens_total{ctn=\"%u\",port=\"%u\"} %lu\n", snap->ctn, snap->com, snap->io.io_reopens);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_io_bytes_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    {
+      CTAPI_Stats_Print (&out, "towitoko_io_bytes_total{ctn=\"%u\",port=\"%u\",direction=\"in\"} %lu\n", snap->ctn, snap->com, snap->io.io_bytes_in);
+      CTAPI_Stats_Print (&out, "towitoko_io_bytes_total{ctn=\"%u\",port=\"%u\",direction=\"out\"} %lu\n", snap->ctn, snap->com, snap->io.io_bytes_out);
+    }
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_io_errors_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    {
+      CTAPI_Stats_Print (&out, "towitoko_io_errors_total{ctn=\"%u\",port=\"%u\",type=\"timeout\"} %lu\n", snap->ctn, snap->com, snap->io.io_timeouts);
+      CTAPI_Stats_Print (&out, "towitoko_io_errors_total{ctn=\"%u\",port=\"%u\",type=\"error\"} %lu\n", snap->ctn, snap->com, snap->io.io_errors);
+    }
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_reader_commands_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    CTAPI_Stats_Print (&out, "towitoko_reader_commands_total{ctn=\"%u\",port=\"%u\"} %lu\n", snap->ctn, snap->com, snap->io.ifd_commands);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_sync_skipped_bytes_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    CTAPI_Stats_Print (&out, "towitoko_sync_skipped_bytes_total{ctn=\"%u\",port=\"%u\"} %lu\n", snap->ctn, snap->com, snap->io.icc_skipped);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_t1_events_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    {
+      CTAPI_Stats_Print (&out, "towitoko_t1_events_total{ctn=\"%u\",port=\"%u\",event=\"wtx\"} %lu\n", snap->ctn, snap->com, snap->io.t1_wtx);
+      CTAPI_Stats_Print (&out, "towitoko_t1_events_total{ctn=\"%u\",port=\"%u\",event=\"error\"} %lu\n", snap->ctn, snap->com, snap->io.t1_errors);
+    }
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_t0_events_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    {
+      CTAPI_Stats_Print (&out, "towitoko_t0_events_total{ctn=\"%u\",port=\"%u\",event=\"null\"} %lu\n", snap->ctn, snap->com, snap->io.t0_nulls);
+      CTAPI_Stats_Print (&out, "towitoko_t0_events_total{ctn=\"%u\",port=\"%u\",event=\"get_response\"} %lu\n", snap->ctn, snap->com, snap->io.t0_get_responses);
+    }
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_latency_seconds summary\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    {
+      CTAPI_Stats_PrintHistogram (&out, snap, "io_read", &(snap->io.io_read));
+      CTAPI_Stats_PrintHistogram (&out, snap, "icc_receive", &(snap->io.icc_receive));
+      CTAPI_Stats_PrintHistogram (&out, snap, "icc_command", &(snap->io.protocol_command));
+      CTAPI_Stats_PrintHistogram (&out, snap, "ct_lock", &(snap->ct.lock));
+      CTAPI_Stats_PrintHistogram (&out, snap, "ct_command", &(snap->ct.command));
+    }
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_card_insertions_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    for (j = 0; j < snap->num_slots; j++)
+      CTAPI_Stats_Print (&out, "towitoko_card_insertions_total{ctn=\"%u\",port=\"%u\",slot=\"%d\"} %lu\n", snap->ctn, snap->com, j, snap->slots[j].insertions);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_card_resets_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    for (j = 0; j < snap->num_slots; j++)
+      CTAPI_Stats_Print (&out, "towitoko_card_resets_total{ctn=\"%u\",port=\"%u\",slot=\"%d\"} %lu\n", snap->ctn, snap->com, j, snap->slots[j].probes);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_card_reset_errors_total counter\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    for (j = 0; j < snap->num_slots; j++)
+      CTAPI_Stats_Print (&out, "towitoko_card_reset_errors_total{ctn=\"%u\",port=\"%u\",slot=\"%d\"} %lu\n", snap->ctn, snap->com, j, snap->slots[j].probe_errors);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_card_protocol gauge\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    for (j = 0; j < snap->num_slots; j++)
+      CTAPI_Stats_Print (&out, "towitoko_card_protocol{ctn=\"%u\",port=\"%u\",slot=\"%d\"} %d\n", snap->ctn, snap->com, j, snap->protocols[j]);
+
+  CTAPI_Stats_Print (&out, "# TYPE towitoko_card_baudrate gauge\n");
+  for (snap = snaps; snap < snaps + num_snaps; snap++)
+    for (j = 0; j < snap->num_slots; j++)
+      CTAPI_Stats_Print (&out, "towitoko_card_baudrate{ctn=\"%u\",port=\"%u\",slot=\"%d\"} %lu\n", snap->ctn, snap->com, j, snap->slots[j].baudrate);
+
+  CTAPI_Stats_Flush (&out);
+
+  if (snaps != NULL)
+    free (snaps);
+}
+
+static void
+CTAPI_Stats_PrintHistogram (CTAPI_Stats_Output * out, CTAPI_Stats_Snapshot * snap, const char *layer, IO_Serial_Histogram * hist)
+{
+  static const double quantiles[] = { 0.5, 0.9, 0.99 };
+  unsigned long count, limit, latency;
+  unsigned i, bucket;
+
+  for (i = 0; i < sizeof (quantiles) / sizeof (quantiles[0]); i++)
+    {
+      /* Upper bound of the bucket holding the quantile, at most the maximum */
+      limit = (unsigned long) (quantiles[i] * hist->count + 0.5);
+
+      for (bucket = 0, count = 0; bucket < IO_SERIAL_STATS_BUCKETS - 1; bucket++)
+	{
+	  count += hist->buckets[bucket];
+
+	  if (count >= MAX (limit, 1))
+	    break;
+	}
+
+      latency = (hist->count == 0) ? 0 : MIN (1UL << bucket, hist->max);
+
+      CTAPI_Stats_Print (out, "towitoko_latency_seconds{ctn=\"%u\",port=\"%u\",layer=\"%s\",quantile=\"%g\"} %.6f\n",
+			 snap->ctn, snap->com, layer, quantiles[i], latency / 1e6);
+    }
+
+  CTAPI_Stats_Print (out, "towitoko_latency_seconds_sum{ctn=\"%u\",port=\"%u\",layer=\"%s\"} %.6f\n", snap->ctn, snap->com, layer, hist->total / 1e6);
+  CTAPI_Stats_Print (out, "towitoko_latency_seconds_count{ctn=\"%u\",port=\"%u\",layer=\"%s\"} %lu\n", snap->ctn, snap->com, layer, hist->count);
+}
+
+static void
+CTAPI_Stats_Print (CTAPI_Stats_Output * out, const char *format, ...)
+{
+  va_list args;
+  int length;
+
+  va_start (args, format);
+  length = vsnprintf (out->buffer + out->length, CTAPI_STATS_BUFFER_SIZE - out->length, format, args);
+  va_end (args);
+
+  /* Line did not fit, send what is buffered and format it again */
+  if ((length >= 0) && (out->length + length >= CTAPI_STATS_BUFFER_SIZE))
+    {
+      CTAPI_Stats_Flush (out);
+
+      va_start (args, format);
+      length = vsnprintf (out->buffer, CTAPI_STATS_BUFFER_SIZE, format, args);
+      va_end (args);
+    }
+
+  if (length > 0)
+    out->length = MIN (out->length + length, CTAPI_STATS_BUFFER_SIZE - 1);
+}
+
+static void
+CTAPI_Stats_Flush (CTAPI_Stats_Output * out)
+{
+  unsigned sent;
+  ssize_t ret;
+
+  for (sent = 0; (sent < out->length) && !out->failed; sent += ret)
+    {
+      ret = send (out->fd, out->buffer + sent, out->length - sent, MSG_NOSIGNAL);
+
+      if (ret <= 0)
+	{
+	  out->failed = TRUE;
+	  break;
+	}
+    }
+
+  out->length = 0;
+}
+#endif
@@ -36,12 +36,72 @@ char CT_data(
        unsigned char  *rsp                /* Response */
        );
 
+/* Towitoko extension: start or stop recording a trace of the traffic */
+char CT_trace(
+       unsigned short ctn,                /* Terminal Number */
+       unsigned char  enable              /* Record events */
+       );
+
+/* Towitoko extension: write the recorded trace to a file */
+char CT_trace_dump(
+       unsigned short ctn,                /* Terminal Number */
+       char           *filename           /* Output file */
+       );
+
+/* Towitoko extension: decode a trace file to the standard output */
+char CT_trace_print(
+       char           *filename           /* Trace file */
+       );
+
+/* Towitoko extension: presence of ICC and change since last check */
+char CT_check(
+       unsigned short ctn,                /* Terminal Number */
+       unsigned short sn,                 /* Slot Number */
+       unsigned char  *card,              /* ICC present */
+       unsigned char  *change             /* ICC inserted or removed */
+       );
+
+/* Towitoko extension: resolve a slot for use with CT_slot_data */
+char CT_get_slot(
+       unsigned short ctn,                /* Terminal Number */
+       unsigned short sn,                 /* Slot Number */
+       void           **ct,               /* Card-terminal handle */
+       void           **slot              /* Slot handle */
+       );
+
+/* Towitoko extension: send a command to an ICC without CT-API addressing */
+char CT_slot_data(
+       void           *ct,                /* Card-terminal handle */
+       void           *slot,              /* Slot handle */
+       unsigned long  lc,                 /* Length of command */
+       unsigned char  *cmd,               /* Command/Data Buffer */
+       unsigned long  *lr,                /* Length of Response */
+       unsigned char  *rsp                /* Response */
+       );
+
+/* Towitoko extension: hold the terminal for the calling thread across calls */
+char CT_begin_transaction(
+       unsigned short ctn,                /* Terminal Number */
+       unsigned short timeout             /* Max seconds held, 0 for no limit */
+       );
+
+/* Towitoko extension: release the terminal held by the calling thread */
+char CT_end_transaction(
+       unsigned short ctn                 /* Terminal Number */
+       );
+
+/* Towitoko extension: abort the command running in the terminal */
+char CT_cancel(
+       unsigned short ctn                 /* Terminal Number */
+       );
+
 
 #define OK               0               /* Success */
 #define ERR_INVALID     -1               /* Invalid Data */
 #define ERR_CT          -8               /* CT Error */
 #define ERR_TRANS       -10              /* Transmission Error */
 #define ERR_MEMORY      -11              /* Memory Allocate Error */
+#define ERR_CANCELLED   -12              /* Cancelled by CT_cancel (Towitoko extension) */
 #define ERR_HTSI        -128             /* HTSI Error */
 
 #define PORT_COM1	   0             /* COM 1 */
@@ -83,6 +83,12 @@
  */
 #define CTBCS_P2_STATUS_MANUFACTURER	0x46	/* Return manufacturer DO */
 #define CTBCS_P2_STATUS_ICC		0x80	/* Return ICC DO */
+#define CTBCS_P2_STATUS_COUNTERS	0xF0	/* Return driver counters (proprietary) */
+#define CTBCS_P2_STATUS_IO_READ		0xF1	/* Return serial read latency histogram (proprietary) */
+#define CTBCS_P2_STATUS_ICC_RECEIVE	0xF2	/* Return ICC reception latency histogram (proprietary) */
+#define CTBCS_P2_STATUS_PROTOCOL	0xF3	/* Return ICC command latency histogram (proprietary) */
+#define CTBCS_P2_STATUS_CT_LOCK		0xF4	/* Return CT-API lock wait histogram (proprietary) */
+#define CTBCS_P2_STATUS_CT_COMMAND	0xF5	/* Return CT-API command latency histogram (proprietary) */
 
 /*
  * General return codes
@@ -70,6 +70,10 @@
 #define ATR_DEFAULT_I 	50
 #define ATR_DEFAULT_N	0
 #define ATR_DEFAULT_P	5
+#define ATR_DEFAULT_WI	10
+#define ATR_DEFAULT_IFSC	32
+#define ATR_DEFAULT_CWI	13
+#define ATR_DEFAULT_BWI	4
 
 /*
  * Exported data types definition
@@ -32,12 +32,61 @@
 #define ICC_ASYNC_MAX_TRANSMIT	255
 #define ICC_ASYNC_BAUDRATE	9600
 
+/*
+ * Not exported variables definition
+ */
+
+#ifndef ICC_ASYNC_INVERT_SHIFT
+/* Inverse convention conversion: ~(INVERT_BYTE (i)) */
+static const BYTE icc_async_invert_table[256] =
+{
+  0xFF, 0x7F, 0xBF, 0x3F, 0xDF, 0x5F, 0x9F, 0x1F,
+  0xEF, 0x6F, 0xAF, 0x2F, 0xCF, 0x4F, 0x8F, 0x0F,
+  0xF7, 0x77, 0xB7, 0x37, 0xD7, 0x57, 0x97, 0x17,
+  0xE7, 0x67, 0xA7, 0x27, 0xC7, 0x47, 0x87, 0x07,
+  0xFB, 0x7B, 0xBB, 0x3B, 0xDB, 0x5B, 0x9B, 0x1B,
+  0xEB, 0x6B, 0xAB, 0x2B, 0xCB, 0x4B, 0x8B, 0x0B,
+  0xF3, 0x73, 0xB3, 0x33, 0xD3, 0x53, 0x93, 0x13,
+  0xE3, 0x63, 0xA3, 0x23, 0xC3, 0x43, 0x83, 0x03,
+  0xFD, 0x7D, 0xBD, 0x3D, 0xDD, 0x5D, 0x9D, 0x1D,
+  0xED, 0x6D, 0xAD, 0x2D, 0xCD, 0x4D, 0x8D, 0x0D,
+  0xF5, 0x75, 0xB5, 0x35, 0xD5, 0x55, 0x95, 0x15,
+  0xE5, 0x65, 0xA5, 0x25, 0xC5, 0x45, 0x85, 0x05,
+  0xF9, 0x79, 0xB9, 0x39, 0xD9, 0x59, 0x99, 0x19,
+  0xE9, 0x69, 0xA9, 0x29, 0xC9, 0x49, 0x89, 0x09,
+  0xF1, 0x71, 0xB1, 0x31, 0xD1, 0x51, 0x91, 0x11,
+  0xE1, 0x61, 0xA1, 0x21, 0xC1, 0x41, 0x81, 0x01,
+  0xFE, 0x7E, 0xBE, 0x3E, 0xDE, 0x5E, 0x9E, 0x1E,
+  0xEE, 0x6E, 0xAE, 0x2E, 0xCE, 0x4E, 0x8E, 0x0E,
+  0xF6, 0x76, 0xB6, 0x36, 0xD6, 0x56, 0x96, 0x16,
+  0xE6, 0x66, 0xA6, 0x26, 0xC6, 0x46, 0x86, 0x06,
+  0xFA, 0x7A, 0xBA, 0x3A, 0xDA, 0x5A, 0x9A, 0x1A,
+  0xEA, 0x6A, 0xAA, 0x2A, 0xCA, 0x4A, 0x8A, 0x0A,
+  0xF2, 0x72, 0xB2, 0x32, 0xD2, 0x52, 0x92, 0x12,
+  0xE2, 0x62, 0xA2, 0x22, 0xC2, 0x42, 0x82, 0x02,
+  0xFC, 0x7C, 0xBC, 0x3C, 0xDC, 0x5C, 0x9C, 0x1C,
+  0xEC, 0x6C, 0xAC, 0x2C, 0xCC, 0x4C, 0x8C, 0x0C,
+  0xF4, 0x74, 0xB4, 0x34, 0xD4, 0x54, 0x94, 0x14,
+  0xE4, 0x64, 0xA4, 0x24, 0xC4, 0x44, 0x84, 0x04,
+  0xF8, 0x78, 0xB8, 0x38, 0xD8, 0x58, 0x98, 0x18,
+  0xE8, 0x68, 0xA8, 0x28, 0xC8, 0x48, 0x88, 0x08,
+  0xF0, 0x70, 0xB0, 0x30, 0xD0, 0x50, 0x90, 0x10,
+  0xE0, 0x60, 0xA0, 0x20, 0xC0, 0x40, 0x80, 0x00
+};
+#endif
+
 /*
  * Not exported functions declaration
  */
 
 static void ICC_Async_InvertBuffer (unsigned size, BYTE * buffer);
+static void ICC_Async_InvertCopy (unsigned size, BYTE * from, BYTE * to);
+static BYTE *ICC_Async_GetBuffer (ICC_Async * icc, unsigned size);
 static void ICC_Async_Clear (ICC_Async * icc);
+static unsigned long ICC_Async_GetTime (unsigned long count, unsigned long rate);
+#ifndef ICC_TYPE_SYNC
+static bool ICC_Async_InitProfile (ICC_Async * icc, IFD * ifd);
+#endif
 
 /*
  * Exported functions definition
@@ -74,25 +123,31 @@ ICC_Async_Init (ICC_Async * icc, IFD * ifd)
     return ICC_ASYNC_IFD_ERROR;
 
   /* Reset ICC */
+  ifd->io->stats.icc_resets++;
+
   if (IFD_Towitoko_ResetAsyncICC (ifd, &(icc->atr)) != IFD_TOWITOKO_OK)
     {
       icc->atr = NULL;
       return ICC_ASYNC_IFD_ERROR;
     }
 
-  /* Get ICC convention */
-  if (ATR_GetConvention (icc->atr, &(icc->convention)) != ATR_OK)
+  /* Get ICC convention and parameters */
+  if (!ICC_Async_InitProfile (icc, ifd))
     {
       ATR_Delete (icc->atr);
       icc->atr = NULL;
-      icc->convention = 0;
+      memset (&(icc->profile), 0, sizeof (ICC_Async_Profile));
 
       return ICC_ASYNC_ATR_ERROR;
     }
   
 #ifdef DEBUG_ICC
   printf("ICC: Detected %s convention processor card\n", 
-	 (icc->convention == ATR_CONVENTION_DIRECT ? "direct" : "inverse"));
+	 (icc->profile.convention == ATR_CONVENTION_DIRECT ? "direct" : "inverse"));
+  printf("ICC: F=%u, D=%u/%u, N=%u, protocols=%X, WI=%u, IFSC=%u, CWI=%u, BWI=%u\n",
+	 icc->profile.f, icc->profile.d, ICC_ASYNC_D_SCALE, icc->profile.n,
+	 icc->profile.protocols, icc->profile.wi, icc->profile.ifsc,
+	 icc->profile.cwi, icc->profile.bwi);
 #endif
 
   /* LED Green */
@@ -100,7 +155,7 @@ ICC_Async_Init (ICC_Async * icc, IFD * ifd)
     {
       ATR_Delete (icc->atr);
       icc->atr = NULL;
-      icc->convention = 0;
+      memset (&(icc->profile), 0, sizeof (ICC_Async_Profile));
 
       return ICC_ASYNC_IFD_ERROR;
     }
@@ -156,12 +211,10 @@ ICC_Async_GetBaudrate (ICC_Async * icc, unsigned long * baudrate)
 int
 ICC_Async_BeginTransmission (ICC_Async * icc)
 {
-  /* Setup parity for this ICC */
-  if (icc->convention == ATR_CONVENTION_INVERSE)
-    {
-      if (IFD_Towitoko_SetParity (icc->ifd, IFD_TOWITOKO_PARITY_ODD) != IFD_TOWITOKO_OK)
-	return ICC_ASYNC_IFD_ERROR;
-    }
+  /* Setup parity for this ICC, only sent to the reader when it changes */
+  if (IFD_Towitoko_SetParity (icc->ifd, (icc->profile.convention == ATR_CONVENTION_INVERSE) ?
+			      IFD_TOWITOKO_PARITY_ODD : IFD_TOWITOKO_PARITY_EVEN) != IFD_TOWITOKO_OK)
+    return ICC_ASYNC_IFD_ERROR;
 
   /* Setup baudrate for  this ICC */
   if (IFD_Towitoko_SetBaudrate (icc->ifd, icc->baudrate)!= IFD_TOWITOKO_OK)
@@ -173,28 +226,28 @@ ICC_Async_BeginTransmission (ICC_Async * icc)
 int
 ICC_Async_Transmit (ICC_Async * icc, unsigned size, BYTE * data)
 {
-  BYTE *buffer = NULL, *sent; 
+  BYTE *sent; 
   IFD_Timings timings;
  
-  if (icc->convention == ATR_CONVENTION_INVERSE)
+  if (icc->profile.convention == ATR_CONVENTION_INVERSE)
     {
-      buffer = (BYTE *) calloc(sizeof (BYTE), size);
-      memcpy (buffer, data, size);
-      ICC_Async_InvertBuffer (size, buffer);
-      sent = buffer;
+      sent = ICC_Async_GetBuffer (icc, size);
+
+      if (sent == NULL)
+	return ICC_ASYNC_IFD_ERROR;
+
+      ICC_Async_InvertCopy (size, data, sent);
     }
   else
     sent = data;
 
   timings.block_delay = icc->timings.block_delay;
   timings.char_delay = icc->timings.char_delay;
+  icc->ifd->io->stats.icc_transmits++;
   
   if (IFD_Towitoko_Transmit (icc->ifd, &timings, size, sent) != IFD_TOWITOKO_OK)
     return ICC_ASYNC_IFD_ERROR;
 
-  if (icc->convention == ATR_CONVENTION_INVERSE)
-      free (buffer);
-
   return ICC_ASYNC_OK;
 }
 
@@ -202,14 +255,24 @@ int
 ICC_Async_Receive (ICC_Async * icc, unsigned size, BYTE * data)
 {
   IFD_Timings timings;
+  IO_Serial_Stats *stats;
+  struct timespec start;
+  int ret;
 
   timings.block_timeout = icc->timings.block_timeout;
   timings.char_timeout = icc->timings.char_timeout;
+
+  stats = IO_Serial_GetStats (icc->ifd->io);
+  stats->icc_receives++;
+  IO_Serial_GetTime (&start);
   
-  if (IFD_Towitoko_Receive (icc->ifd, &timings, size, data) != IFD_TOWITOKO_OK)
+  ret = IFD_Towitoko_Receive (icc->ifd, &timings, size, data);
+  IO_Serial_AddLatency (&(stats->icc_receive), &start);
+
+  if (ret != IFD_TOWITOKO_OK)
     return ICC_ASYNC_IFD_ERROR;
 
-  if (icc->convention == ATR_CONVENTION_INVERSE)
+  if (icc->profile.convention == ATR_CONVENTION_INVERSE)
     ICC_Async_InvertBuffer (size, data);
 
   return ICC_ASYNC_OK;
@@ -227,25 +290,19 @@ ICC_Async_Switch (ICC_Async * icc)
   return ICC_ASYNC_OK;
 }
 
-int
-ICC_Async_EndTransmission (ICC_Async * icc)
-{
-  /* Restore parity */
-  if (icc->convention == ATR_CONVENTION_INVERSE)
-    {
-      if (IFD_Towitoko_SetParity (icc->ifd, IFD_TOWITOKO_PARITY_EVEN) != IFD_TOWITOKO_OK)
-	return ICC_ASYNC_IFD_ERROR;
-    }
-
-  return ICC_ASYNC_OK;
-}
-
 ATR *
 ICC_Async_GetAtr (ICC_Async * icc)
 {
   return icc->atr;
 }
 
+ICC_Async_Profile *
+ICC_Async_GetProfile (ICC_Async * icc)
+{
+  /* Read only, valid until the ICC is closed */
+  return &(icc->profile);
+}
+
 IFD *
 ICC_Async_GetIFD (ICC_Async * icc)
 {
@@ -259,6 +316,16 @@ ICC_Async_Close (ICC_Async * icc)
   if (IFD_Towitoko_DeactivateICC (icc->ifd) != IFD_TOWITOKO_OK)
     return ICC_ASYNC_IFD_ERROR;
 
+  /* 
+   * Restore parity, left odd between commands to an inverse convention
+   * ICC, before a synchronous ICC is probed in this slot
+   */
+  if (icc->profile.convention == ATR_CONVENTION_INVERSE)
+    {
+      if (IFD_Towitoko_SetParity (icc->ifd, IFD_TOWITOKO_PARITY_EVEN) != IFD_TOWITOKO_OK)
+	return ICC_ASYNC_IFD_ERROR;
+    }
+
   /* LED Off */
   if (IFD_Towitoko_SetLED (icc->ifd, IFD_TOWITOKO_LED_OFF) != IFD_TOWITOKO_OK)
     return ICC_ASYNC_IFD_ERROR;
@@ -266,6 +333,10 @@ ICC_Async_Close (ICC_Async * icc)
   /* Delete atr */
   ATR_Delete (icc->atr);
 
+  /* Free scratch buffer */
+  if (icc->buffer != NULL)
+    free (icc->buffer);
+
   ICC_Async_Clear (icc);
 
   return ICC_ASYNC_OK;
@@ -277,9 +348,36 @@ ICC_Async_GetClockRate (ICC_Async * icc)
   return IFD_Towitoko_GetClockRate(icc->ifd);
 }
 
+void
+ICC_Async_Trace (ICC_Async * icc, BYTE type, unsigned size, BYTE * data)
+{
+  IO_SERIAL_TRACE (icc->ifd->io, type, size, data);
+}
+
+IO_Serial_Stats *
+ICC_Async_GetStats (ICC_Async * icc)
+{
+  return IO_Serial_GetStats (icc->ifd->io);
+}
+
+unsigned long
+ICC_Async_GetEtuTime (ICC_Async * icc, unsigned long etu)
+{
+  return ICC_Async_GetTime (etu, icc->baudrate);
+}
+
+unsigned long
+ICC_Async_GetClockTime (ICC_Async * icc, unsigned long cycles)
+{
+  return ICC_Async_GetTime (cycles, ICC_Async_GetClockRate (icc));
+}
+
 void
 ICC_Async_Delete (ICC_Async * icc)
 {
+  if (icc->buffer != NULL)
+    free (icc->buffer);
+
   free (icc);
 }
 
@@ -290,10 +388,44 @@ ICC_Async_Delete (ICC_Async * icc)
 static void
 ICC_Async_InvertBuffer (unsigned size, BYTE * buffer)
 {
-  int i;
+  ICC_Async_InvertCopy (size, buffer, buffer);
+}
+
+static void
+ICC_Async_InvertCopy (unsigned size, BYTE * from, BYTE * to)
+{
+  unsigned i;
 
+  /* 
+   * The shift and mask form is only faster when the compiler vectorizes
+   * it, which gcc does at -O3 but not at -O2 (see src/test/invert.c)
+   */
   for (i = 0; i < size; i++)
-    buffer[i] = ~(INVERT_BYTE (buffer[i]));
+#ifndef ICC_ASYNC_INVERT_SHIFT
+    to[i] = icc_async_invert_table[from[i]];
+#else
+    to[i] = ~(INVERT_BYTE (from[i]));
+#endif
+}
+
+static BYTE *
+ICC_Async_GetBuffer (ICC_Async * icc, unsigned size)
+{
+  BYTE *buffer;
+
+  /* Scratch buffer only grows, it is kept until the ICC is closed */
+  if (size > icc->buffer_size)
+    {
+      buffer = (BYTE *) realloc (icc->buffer, MAX (size, ICC_ASYNC_MAX_TRANSMIT));
+
+      if (buffer == NULL)
+	return NULL;
+
+      icc->buffer = buffer;
+      icc->buffer_size = MAX (size, ICC_ASYNC_MAX_TRANSMIT);
+    }
+
+  return icc->buffer;
 }
 
 static void
@@ -301,10 +433,120 @@ ICC_Async_Clear (ICC_Async * icc)
 {
   icc->ifd = NULL;
   icc->atr = NULL;
+  icc->buffer = NULL;
+  icc->buffer_size = 0;
   icc->baudrate = 0L;
-  icc->convention = 0;
+  memset (&(icc->profile), 0, sizeof (ICC_Async_Profile));
   icc->timings.block_delay = 0;
   icc->timings.char_delay = 0;
   icc->timings.block_timeout = 0;
   icc->timings.char_timeout = 0;
 }
+
+static unsigned long
+ICC_Async_GetTime (unsigned long count, unsigned long rate)
+{
+  unsigned long unit;
+
+  if (rate == 0)
+    return 0;
+
+  /* Nanoseconds per unit, rounded up so timeouts are never too short */
+  unit = (1000000000L + rate - 1) / rate;
+
+  /* Split count so that the products fit in 32 bits */
+  return (count / 1000) * unit + ((count % 1000) * unit + 999) / 1000;
+}
+
+#ifndef ICC_TYPE_SYNC
+static bool
+ICC_Async_InitProfile (ICC_Async * icc, IFD * ifd)
+{
+  ICC_Async_Profile *profile = &(icc->profile);
+  ATR *atr = icc->atr;
+  unsigned long clock;
+  unsigned i, np;
+  BYTE value, t;
+
+  memset (profile, 0, sizeof (ICC_Async_Profile));
+
+  if (ATR_GetConvention (atr, &(profile->convention)) != ATR_OK)
+    return FALSE;
+
+  /* Fi and Di, RFU values are taken as the defaults */
+  profile->f = ATR_DEFAULT_F;
+  profile->d = ATR_DEFAULT_D * ICC_ASYNC_D_SCALE;
+
+  if (ATR_GetIntegerValue (atr, ATR_INTEGER_VALUE_FI, &value) == ATR_OK)
+    if (atr_f_table[value] != 0)
+      profile->f = atr_f_table[value];
+
+  if (ATR_GetIntegerValue (atr, ATR_INTEGER_VALUE_DI, &value) == ATR_OK)
+    if (atr_d_table[value] != 0)
+      profile->d = (unsigned) (atr_d_table[value] * ICC_ASYNC_D_SCALE);
+
+  if (ATR_GetIntegerValue (atr, ATR_INTEGER_VALUE_N, &value) == ATR_OK)
+    profile->n = value;
+  else
+    profile->n = ATR_DEFAULT_N;
+
+  /* Baudrate = Di * fs / Fi, Di is a power of two when fractional */
+  clock = IFD_Towitoko_GetClockRate (ifd);
+
+  if (profile->d >= ICC_ASYNC_D_SCALE)
+    profile->baudrate = (clock * (profile->d / ICC_ASYNC_D_SCALE)) / profile->f;
+  else
+    profile->baudrate = clock / ((ICC_ASYNC_D_SCALE / profile->d) * profile->f);
+
+  /* Offered protocols, the first one is indicated in TD1 */
+  ATR_GetNumberOfProtocols (atr, &np);
+
+  profile->t = ATR_PROTOCOL_TYPE_T0;
+  profile->protocols = (1 << ATR_PROTOCOL_TYPE_T0);
+
+  for (i = 2; i <= np; i++)
+    {
+      if (ATR_GetProtocolType (atr, i, &t) != ATR_OK)
+	continue;
+
+      if (i == 2)
+	{
+	  profile->t = t;
+	  profile->protocols = 0;
+	}
+
+      profile->protocols |= (1 << t);
+    }
+
+  /* T=0 waiting time integer is TC2 */
+  if (ATR_GetInterfaceByte (atr, 2, ATR_INTERFACE_BYTE_TC, &value) == ATR_OK)
+    profile->wi = value;
+  else
+    profile->wi = ATR_DEFAULT_WI;
+
+  /* T=1 parameters are in the third group of interface bytes */
+  if ((ATR_GetInterfaceByte (atr, 3, ATR_INTERFACE_BYTE_TA, &value) == ATR_OK) &&
+      (value != 0x00) && (value != 0xFF))
+    profile->ifsc = value;
+  else
+    profile->ifsc = ATR_DEFAULT_IFSC;
+
+  if (ATR_GetInterfaceByte (atr, 3, ATR_INTERFACE_BYTE_TB, &value) == ATR_OK)
+    {
+      profile->cwi = value & 0x0F;
+      profile->bwi = (value & 0xF0) >> 4;
+    }
+  else
+    {
+      profile->cwi = ATR_DEFAULT_CWI;
+      profile->bwi = ATR_DEFAULT_BWI;
+    }
+
+  if (ATR_GetInterfaceByte (atr, 3, ATR_INTERFACE_BYTE_TC, &value) == ATR_OK)
+    profile->edc = value & 0x01;
+  else
+    profile->edc = ICC_ASYNC_EDC_LRC;
+
+  return TRUE;
+}
+#endif
@@ -36,26 +36,53 @@
 #define ICC_ASYNC_IFD_ERROR     1
 #define ICC_ASYNC_ATR_ERROR     2
 
+/* Fixed point scale of Di in the card profile */
+#define ICC_ASYNC_D_SCALE       64
+
+/* Error detection code of T=1 */
+#define ICC_ASYNC_EDC_LRC       0
+#define ICC_ASYNC_EDC_CRC       1
+
 /*
  * Exported types definition
  */
 
 typedef struct
 {
-  unsigned block_delay;          /* Delay (ms) after starting to transmit */
-  unsigned char_delay;           /* Delay (ms) after transmiting each sucesive char*/
-  unsigned block_timeout;        /* Max timeout (ms) to receive first char */
-  unsigned char_timeout;         /* Max timeout (ms) to receive sucesive characters */
+  unsigned long block_delay;     /* Delay (us) after starting to transmit */
+  unsigned long char_delay;      /* Delay (us) after transmiting each sucesive char*/
+  unsigned long block_timeout;   /* Max timeout (us) to receive first char */
+  unsigned long char_timeout;    /* Max timeout (us) to receive sucesive characters */
 }
 ICC_Async_Timings;
 
+/* Card profile, computed once from the ATR */
+typedef struct
+{
+  int convention;               /* Convention of this ICC */
+  unsigned f;                   /* Clock rate conversion factor Fi */
+  unsigned d;                   /* Baudrate adjustment factor Di, times ICC_ASYNC_D_SCALE */
+  BYTE n;                       /* Extra guard time (etu) */
+  unsigned long baudrate;       /* Baudrate (bps) at Fi and Di, 1 etu = 1/baudrate s */
+  BYTE t;                       /* Protocol type indicated in TD1, T=0 if absent */
+  unsigned protocols;           /* Offered protocol types, bit (1 << T) */
+  BYTE wi;                      /* T=0 waiting time integer */
+  BYTE ifsc;                    /* T=1 information field size for the ICC */
+  BYTE cwi;                     /* T=1 character waiting time integer */
+  BYTE bwi;                     /* T=1 block waiting time integer */
+  int edc;                      /* T=1 error detection code */
+}
+ICC_Async_Profile;
+
 typedef struct
 {
   IFD *ifd;                     /* Interface device */
   ATR *atr;                     /* Answer to reset of this ICC */
-  int convention;               /* Convention of this ICC */
+  ICC_Async_Profile profile;    /* Parameters of this ICC from its ATR */
   unsigned long baudrate;	/* Current baudrate (bps) for transmiting to this ICC */
   ICC_Async_Timings timings;    /* Current timings for transmiting to this ICC */
+  BYTE *buffer;                 /* Scratch buffer for inverse convention data */
+  unsigned buffer_size;         /* Size of the scratch buffer */
 }
 ICC_Async;
 
@@ -77,15 +104,25 @@ extern int ICC_Async_GetTimings (ICC_Async * icc, ICC_Async_Timings * timings);
 extern int ICC_Async_SetBaudrate (ICC_Async * icc, unsigned long baudrate);
 extern int ICC_Async_GetBaudrate (ICC_Async * icc, unsigned long * baudrate);
 extern ATR *ICC_Async_GetAtr (ICC_Async * icc);
+extern ICC_Async_Profile *ICC_Async_GetProfile (ICC_Async * icc);
 extern IFD *ICC_Async_GetIFD (ICC_Async * icc);
 extern unsigned long ICC_Async_GetClockRate (ICC_Async * icc);
 
+/* Time (us) taken by a number of etu or clock cycles */
+extern unsigned long ICC_Async_GetEtuTime (ICC_Async * icc, unsigned long etu);
+extern unsigned long ICC_Async_GetClockTime (ICC_Async * icc, unsigned long cycles);
+
+/* Record a protocol event in the trace of the serial device */
+extern void ICC_Async_Trace (ICC_Async * icc, BYTE type, unsigned size, BYTE * data);
+
+/* Counters of the serial device, for the protocol layers */
+extern IO_Serial_Stats *ICC_Async_GetStats (ICC_Async * icc);
+
 /* Operations */
 extern int ICC_Async_BeginTransmission (ICC_Async * icc);
 extern int ICC_Async_Transmit (ICC_Async * icc, unsigned size, BYTE * buffer);
 extern int ICC_Async_Receive (ICC_Async * icc, unsigned size, BYTE * buffer);
 extern int ICC_Async_Switch (ICC_Async * icc);
-extern int ICC_Async_EndTransmission (ICC_Async * icc);
 
 #endif /* _ICC_ASYNC_ */
 
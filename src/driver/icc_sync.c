@@ -40,6 +40,8 @@
 #define ICC_SYNC_I2C_MAX_RETRIES	2
 #define ICC_SYNC_I2C_RETRY_TRIGGER	1
 #define ICC_SYNC_BAUDRATE		115200L
+#define ICC_SYNC_DIFF_BLOCK		16	/* Compare granularity when
+						   card has no pagemode */
 
 
 /*
@@ -59,6 +61,7 @@
 
 static int ICC_Sync_ProbeCardType (ICC_Sync * icc);
 static int ICC_Sync_ProbeMemoryLength (ICC_Sync * icc);
+static bool ICC_Sync_ProbeAddress (ICC_Sync * icc, unsigned address);
 static int ICC_Sync_ProbePagemode (ICC_Sync * icc);
 static ATR_Sync * ICC_Sync_CreateAtr(ICC_Sync * icc);
 static void ICC_Sync_Clear (ICC_Sync * icc);
@@ -326,6 +329,86 @@ ICC_Sync_Write (ICC_Sync * icc, unsigned short address, unsigned length,
   return ICC_SYNC_OK;
 }
 
+int
+ICC_Sync_Update (ICC_Sync * icc, unsigned short address, unsigned length,
+		 BYTE * data, unsigned *skipped)
+{
+  BYTE *current;
+  unsigned block, offset, to_compare, start;
+  bool dirty;
+  int ret;
+
+  (*skipped) = 0;
+
+  if (length == 0)
+    return ICC_SYNC_OK;
+
+  current = (BYTE *) malloc (length);
+
+  if (current == NULL)
+    return ICC_Sync_Write (icc, address, length, data);
+
+  /* Read current contents once */
+  ret = ICC_Sync_Read (icc, address, length, current);
+
+  if (ret != ICC_SYNC_OK)
+    {
+      free (current);
+      return ret;
+    }
+
+  /* Compare in blocks aligned to the write page */
+  block = (icc->pagemode != 0x00) ? icc->pagemode : ICC_SYNC_DIFF_BLOCK;
+
+  /* Write each run of consecutive dirty blocks in one call */
+  start = 0;
+  dirty = FALSE;
+  ret = ICC_SYNC_OK;
+
+  for (offset = 0; offset < length; offset += to_compare)
+    {
+      to_compare = MIN (length - offset,
+			block - ((address + offset) % block));
+
+      if (memcmp (data + offset, current + offset, to_compare) != 0)
+	{
+	  if (!dirty)
+	    {
+	      start = offset;
+	      dirty = TRUE;
+	    }
+	}
+      else
+	{
+	  if (dirty)
+	    {
+	      ret = ICC_Sync_Write (icc, address + start, offset - start,
+				    data + start);
+	      dirty = FALSE;
+
+	      if (ret != ICC_SYNC_OK)
+		break;
+	    }
+
+	  (*skipped) += to_compare;
+	}
+    }
+
+  if (dirty && ret == ICC_SYNC_OK)
+    ret = ICC_Sync_Write (icc, address + start, length - start, data + start);
+
+  free (current);
+
+  icc->ifd->io->stats.icc_skipped += (*skipped);
+
+#ifdef DEBUG_ICC
+  printf ("ICC: Updated %d bytes, %d bytes unchanged\n",
+	  length - (*skipped), (*skipped));
+#endif
+
+  return ret;
+}
+
 int
 ICC_Sync_EnterPin (ICC_Sync * icc, BYTE * pin, unsigned *trials)
 {
@@ -565,8 +648,7 @@ ICC_Sync_ProbeMemoryLength (ICC_Sync * icc)
 {
   int ret;
 #ifndef ICC_SYNC_MEMORY_LENGTH
-  unsigned min, max;
-  BYTE status[1];
+  unsigned min, steps, low, high, mid;
 
   if (icc->atr != NULL)
     {
@@ -579,30 +661,38 @@ ICC_Sync_ProbeMemoryLength (ICC_Sync * icc)
       if  (icc->type == ICC_SYNC_I2C_SHORT)
         {
 	  min = 256L;
-	  max = 2048L;
+	  steps = 3;		/* Up to 2048 */
 	}
       else if (icc->type == ICC_SYNC_I2C_LONG)
         {
 	  min = 2048L;
-	  max = 32768L;
+	  steps = 4;		/* Up to 32768 */
 	}
       else
 	{
 	  min = 256L;
-	  max = 2048L;
+	  steps = 3;		/* Up to 2048 */
 	}
 
-      for (icc->length = min; icc->length<max; icc->length*=2)
-        {
-          IFD_Towitoko_SetReadAddress (icc->ifd,  icc->type, icc->length);
-          IFD_Towitoko_GetStatus  (icc->ifd, status);
-          IFD_Towitoko_DeactivateICC (icc->ifd);
-          IFD_Towitoko_ActivateICC (icc->ifd);
+      /* 
+       * Memory length is the first power of two whose address is 
+       * not acknowledged: binary search over the exponent
+       */
+      low = 0;
+      high = steps;
 
-          if ((status[0] & 0x10) == 0x10)
-	    break;
+      while (low < high)
+	{
+	  mid = (low + high) / 2;
+
+	  if (ICC_Sync_ProbeAddress (icc, min << mid))
+	    high = mid;
+	  else
+	    low = mid + 1;
 	}
 
+      icc->length = min << low;
+
       ret = ICC_SYNC_OK;
     }
 
@@ -618,6 +708,20 @@ ICC_Sync_ProbeMemoryLength (ICC_Sync * icc)
   return ret;
 }
 
+static bool
+ICC_Sync_ProbeAddress (ICC_Sync * icc, unsigned address)
+{
+  BYTE status[1];
+
+  /* Address beyond the end of memory is not acknowledged */
+  IFD_Towitoko_SetReadAddress (icc->ifd, icc->type, address);
+  IFD_Towitoko_GetStatus (icc->ifd, status);
+  IFD_Towitoko_DeactivateICC (icc->ifd);
+  IFD_Towitoko_ActivateICC (icc->ifd);
+
+  return ((status[0] & 0x10) == 0x10);
+}
+
 static int
 ICC_Sync_ProbePagemode (ICC_Sync * icc)
 {
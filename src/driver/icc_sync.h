@@ -93,6 +93,7 @@ int ICC_Sync_GetBaudrate (ICC_Sync * icc, unsigned long * baudrate);
 int ICC_Sync_BeginTransmission (ICC_Sync * icc);
 int ICC_Sync_Read (ICC_Sync * icc, unsigned short address, unsigned length, BYTE * data);
 int ICC_Sync_Write (ICC_Sync * icc, unsigned short address, unsigned length, BYTE * data);
+int ICC_Sync_Update (ICC_Sync * icc, unsigned short address, unsigned length, BYTE * data, unsigned *skipped);
 int ICC_Sync_EnterPin (ICC_Sync * icc, BYTE * pin, unsigned *trials);
 int ICC_Sync_ChangePin (ICC_Sync * icc, BYTE * pin);
 
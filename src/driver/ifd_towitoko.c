@@ -35,9 +35,19 @@
 
 #define IFD_TOWITOKO_TIMEOUT             1000
 #define IFD_TOWITOKO_DELAY               0
+
+/* Reader and serial latency (ms) added to the card receive timeouts */
+#ifndef IFD_TOWITOKO_BLOCK_MARGIN
+#define IFD_TOWITOKO_BLOCK_MARGIN        200
+#endif
+
+#ifndef IFD_TOWITOKO_CHAR_MARGIN
+#define IFD_TOWITOKO_CHAR_MARGIN         50
+#endif
 #define IFD_TOWITOKO_BAUDRATE            9600
 #define IFD_TOWITOKO_PS                  15
 #define IFD_TOWITOKO_MAX_TRANSMIT        255
+#define IFD_TOWITOKO_MAX_FRAME           (IFD_TOWITOKO_MAX_TRANSMIT + 7)	/* Prefix, header and data */
 #define IFD_TOWITOKO_ATR_TIMEOUT	 400
 #define IFD_TOWITOKO_ATR_MIN_LENGTH      1
 #define IFD_TOWITOKO_CLOCK_RATE          (372L * 9600L)
@@ -49,9 +59,10 @@
  * Not exported functions declaration
  */
 
-static int IFD_Towitoko_PrepareCommand (IFD * ifd, BYTE * command, BYTE size);
 static BYTE IFD_Towitoko_Checksum (BYTE * cmd, unsigned size, BYTE init);
-static int IFD_Towitoko_GetReaderInfo (IFD * ifd);
+static unsigned IFD_Towitoko_FrameCommand (IFD * ifd, BYTE * command, BYTE size, BYTE * frame);
+static bool IFD_Towitoko_SendCommand (IFD * ifd, BYTE * command, BYTE size);
+static unsigned IFD_Towitoko_GetTimeout (unsigned long timeout, unsigned margin);
 static unsigned IFD_Towitoko_NumTrials (BYTE b);
 static void IFD_Towitoko_Clear (IFD * ifd);
 
@@ -107,6 +118,7 @@ IFD_Towitoko_Init (IFD * ifd, IO_Serial * io, BYTE slot)
   ifd->io = io;
   ifd->slot = slot;
   ifd->type = IFD_TOWITOKO_UNKNOWN;
+  ifd->parity = 0;
 
   ret = IFD_Towitoko_SetBaudrate (ifd, IFD_TOWITOKO_BAUDRATE);
 
@@ -271,10 +283,10 @@ IFD_Towitoko_SetBaudrate (IFD * ifd, unsigned long baudrate)
 
   buffer[2] = buffer[1] ^ 0x5D;
 
-  IFD_Towitoko_PrepareCommand (ifd, buffer, 6);
-
   /* Set  ifd baudrate requested */
-  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 6, buffer))
+  ifd->io->stats.ifd_baudrates++;
+
+  if (!IFD_Towitoko_SendCommand (ifd, buffer, 6))
     return IFD_TOWITOKO_IO_ERROR;
 
   if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -340,6 +352,19 @@ IFD_Towitoko_SetParity (IFD * ifd, BYTE parity)
   if (!IO_Serial_GetProperties (ifd->io, &props))
     return IFD_TOWITOKO_IO_ERROR;
 
+  /*
+   * Reader already set to this parity, unless the other slot of a
+   * Chipdrive Twin changed it since: both share the serial device,
+   * whose parity follows the parity last set in the reader
+   */
+  if ((ifd->parity == parity) &&
+      (props.parity == ((parity == IFD_TOWITOKO_PARITY_ODD) ?
+			IO_SERIAL_PARITY_ODD : IO_SERIAL_PARITY_EVEN)))
+    return IFD_TOWITOKO_OK;
+
+  /* Unknown until the whole sequence succeeds */
+  ifd->parity = 0;
+
   /* Set serial device parity to even */
   if (props.parity == IO_SERIAL_PARITY_ODD)
     {
@@ -351,10 +376,9 @@ IFD_Towitoko_SetParity (IFD * ifd, BYTE parity)
 
   /* Set ifd parity as requested */
   buffer[1] = parity;
+  ifd->io->stats.ifd_parities++;
 
-  IFD_Towitoko_PrepareCommand (ifd, buffer, 5);
-  
-  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 5, buffer))
+  if (!IFD_Towitoko_SendCommand (ifd, buffer, 5))
     return IFD_TOWITOKO_IO_ERROR;
 
   if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -375,9 +399,18 @@ IFD_Towitoko_SetParity (IFD * ifd, BYTE parity)
 	return IFD_TOWITOKO_IO_ERROR;
     }
 
+  ifd->parity = parity;
+
   return IFD_TOWITOKO_OK;
 }
 
+void
+IFD_Towitoko_ForgetParity (IFD * ifd)
+{
+  /* Sent to the reader again by the next IFD_Towitoko_SetParity */
+  ifd->parity = 0;
+}
+
 int
 IFD_Towitoko_SetLED (IFD * ifd, BYTE color)
 {
@@ -399,9 +432,7 @@ IFD_Towitoko_SetLED (IFD * ifd, BYTE color)
 
   buffer[1] = color;
 
-  IFD_Towitoko_PrepareCommand (ifd, buffer, 5);
-
-  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 5, buffer))
+  if (!IFD_Towitoko_SendCommand (ifd, buffer, 5))
     return IFD_TOWITOKO_IO_ERROR;
 
   if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -419,9 +450,7 @@ IFD_Towitoko_GetStatus (IFD * ifd, BYTE * result)
   BYTE buffer[2] = { 0x03, 0x07 };
   BYTE status[2];
 
-  IFD_Towitoko_PrepareCommand (ifd, buffer, 2);
-
-  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 2, buffer))
+  if (!IFD_Towitoko_SendCommand (ifd, buffer, 2))
     return IFD_TOWITOKO_IO_ERROR;
 
   if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 2, status))
@@ -430,9 +459,7 @@ IFD_Towitoko_GetStatus (IFD * ifd, BYTE * result)
        * First read can exceed timeout if card has just
        * been inserted or removed
        */
-      IFD_Towitoko_PrepareCommand (ifd, buffer, 2);
-      
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 2, buffer))
+      if (!IFD_Towitoko_SendCommand (ifd, buffer, 2))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 2, status))
@@ -450,19 +477,114 @@ IFD_Towitoko_GetStatus (IFD * ifd, BYTE * result)
   return IFD_TOWITOKO_OK;
 }
 
+int
+IFD_Towitoko_WaitStatus (IFD * ifd, unsigned timeout)
+{
+  /* Returns as soon as the reader signals a change on the modem lines */
+  IO_Serial_WaitLines (ifd->io, timeout);
+
+  return IFD_TOWITOKO_OK;
+}
+
+int
+IFD_Towitoko_GetReaderInfo (IFD * ifd)
+{
+  BYTE status[3];
+  BYTE buffer[2] = { 0x00, 0x01};
+
+  buffer[1] = IFD_Towitoko_Checksum (buffer, 1, ifd->slot);
+  
+  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 2, buffer))
+    return IFD_TOWITOKO_IO_ERROR;
+
+  if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 3, status))
+    return IFD_TOWITOKO_IO_ERROR;
+
+  ifd->type = status[0];
+  ifd->firmware = status[1];
+
+#ifdef DEBUG_IFD
+  printf ("IFD: Reader type = %s\n",
+	  status[0] == IFD_TOWITOKO_CHIPDRIVE_EXT_II ? "Chipdrive Extern II" :
+	  status[0] == IFD_TOWITOKO_CHIPDRIVE_EXT_I ? "Chipdrive Extern I" :
+	  status[0] == IFD_TOWITOKO_CHIPDRIVE_INT ? "Chipdrive Intern" :
+	  status[0] == IFD_TOWITOKO_CHIPDRIVE_MICRO ? "Chipdrive Micro" :
+	  status[0] == IFD_TOWITOKO_KARTENZWERG_II ? "Kartenzwerg II" :
+	  status[0] == IFD_TOWITOKO_KARTENZWERG ? "Kartenzwerg" : "Unknown");
+#endif
+  
+  return IFD_TOWITOKO_OK;
+}
+
+int
+IFD_Towitoko_Restore (IFD * ifd, bool * reset)
+{
+  IO_Serial_Properties props, saved;
+  BYTE parity;
+  int ret;
+
+  (*reset) = FALSE;
+
+  /* Still answering with the settings replayed by the serial device */
+  if (IFD_Towitoko_GetReaderInfo (ifd) == IFD_TOWITOKO_OK)
+    return IFD_TOWITOKO_OK;
+
+  if (!IO_Serial_GetProperties (ifd->io, &saved))
+    return IFD_TOWITOKO_IO_ERROR;
+
+  /* The serial parity follows the parity of the reader */
+  parity = (saved.parity == IO_SERIAL_PARITY_ODD) ? IFD_TOWITOKO_PARITY_ODD : IFD_TOWITOKO_PARITY_EVEN;
+
+  /* Powered off with the adapter, so back to the settings of IFD_Towitoko_Init */
+  props = saved;
+  props.input_bitrate = IFD_TOWITOKO_BAUDRATE;
+  props.output_bitrate = IFD_TOWITOKO_BAUDRATE;
+  props.parity = IO_SERIAL_PARITY_EVEN;
+  props.stopbits = 2;
+
+  if (!IO_Serial_SetProperties (ifd->io, &props))
+    return IFD_TOWITOKO_IO_ERROR;
+
+  if (IFD_Towitoko_GetReaderInfo (ifd) != IFD_TOWITOKO_OK)
+    {
+      /* Not answering at all, the settings are kept for a later attempt */
+      IO_Serial_SetProperties (ifd->io, &saved);
+      return IFD_TOWITOKO_IO_ERROR;
+    }
+
+  (*reset) = TRUE;
+  ifd->parity = 0;
+
+  if (ifd->type == IFD_TOWITOKO_KARTENZWERG)
+    {
+      props.parity = IO_SERIAL_PARITY_NONE;
+      props.stopbits = 1;
+
+      if (!IO_Serial_SetProperties (ifd->io, &props))
+	return IFD_TOWITOKO_IO_ERROR;
+
+      return IFD_Towitoko_SetBaudrate (ifd, saved.output_bitrate);
+    }
+
+  ret = IFD_Towitoko_SetBaudrate (ifd, saved.output_bitrate);
+
+  if (ret != IFD_TOWITOKO_OK)
+    return ret;
+
+  return IFD_Towitoko_SetParity (ifd, parity);
+}
+
 int
 IFD_Towitoko_ActivateICC (IFD * ifd)
 {
   BYTE status[1];
   BYTE buffer[3] = { 0x60, 0x0F, 0x9C };
 
-  IFD_Towitoko_PrepareCommand (ifd, buffer, 3);
-
 #ifdef DEBUG_IFD
   printf ("IFD: Activating card\n");
 #endif
 
-  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 3, buffer))
+  if (!IFD_Towitoko_SendCommand (ifd, buffer, 3))
     return IFD_TOWITOKO_IO_ERROR;
 
   if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -480,13 +602,11 @@ IFD_Towitoko_DeactivateICC (IFD * ifd)
   BYTE status[1];
   BYTE buffer[3] = { 0x61, 0x0F, 0x98 };
 
-  IFD_Towitoko_PrepareCommand (ifd, buffer, 3);
-  
 #ifdef DEBUG_IFD
   printf ("IFD: Deactivating card\n");
 #endif
 
-  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 3, buffer))
+  if (!IFD_Towitoko_SendCommand (ifd, buffer, 3))
     return IFD_TOWITOKO_IO_ERROR;
 
   if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -520,7 +640,12 @@ IFD_Towitoko_ResetAsyncICC (IFD * ifd, ATR ** atr)
 #endif
 
 #ifndef IFD_TOWITOKO_CONVENTION_INVERSE
+  /* Reader may have been left in odd parity by the previous card */
   parity = IFD_TOWITOKO_PARITY_EVEN;
+  ret = IFD_Towitoko_SetParity (ifd, parity);
+
+  if (ret != IFD_TOWITOKO_OK)
+    return ret;
 #else
   parity = IFD_TOWITOKO_PARITY_ODD;
   ret = IFD_Towitoko_SetParity (ifd, parity);
@@ -536,6 +661,8 @@ IFD_Towitoko_ResetAsyncICC (IFD * ifd, ATR ** atr)
       for (i = 0; i < 2; i++)
 	{
 	  /* Try active-low reset */
+	  ifd->io->stats.ifd_commands++;
+
 	  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 5, buffer2))
 	    break;
 
@@ -569,6 +696,8 @@ IFD_Towitoko_ResetAsyncICC (IFD * ifd, ATR ** atr)
 	  (*atr) = NULL;
 
 	  /* Try active-high reset */
+	  ifd->io->stats.ifd_commands++;
+
 	  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 5, buffer1))
 	    break;
 
@@ -631,8 +760,10 @@ IFD_Towitoko_ResetAsyncICC (IFD * ifd, ATR ** atr)
 int
 IFD_Towitoko_Transmit (IFD * ifd, IFD_Timings * timings, unsigned size, BYTE * buffer)
 {
-  BYTE header[6] = {0x6F, 0x00, 0x05, 0x00, 0xFE, 0xF8};
-  unsigned block_delay, char_delay, sent=0, to_send = 0;
+  BYTE header[4] = {0x6F, 0x00, 0x05, 0x00};
+  BYTE frame[IFD_TOWITOKO_MAX_FRAME];
+  unsigned long block_delay, char_delay, char_time;
+  unsigned sent=0, to_send = 0, length;
   IO_Serial_Properties props;
   bool s = FALSE;
 
@@ -652,37 +783,54 @@ IFD_Towitoko_Transmit (IFD * ifd, IFD_Timings * timings, unsigned size, BYTE * b
 
   s = (props.output_bitrate > IFD_TOWITOKO_BAUDRATE);
   
-  /* Calculate delays */
-  char_delay = IFD_TOWITOKO_DELAY + timings->char_delay;
-  block_delay = IFD_TOWITOKO_DELAY + timings->block_delay;
+  /* Calculate delays (us) */
+  char_delay = IFD_TOWITOKO_DELAY * 1000L + timings->char_delay;
+  block_delay = IFD_TOWITOKO_DELAY * 1000L + timings->block_delay;
+
+  /* Guard times not longer than a character frame are kept by the UART */
+  char_time = IO_Serial_GetCharTime (ifd->io);
+
+  if (char_delay <= char_time)
+    char_delay = 0;
+
+  if (block_delay <= char_time)
+    block_delay = 0;
 
   for (sent = 0; sent < size; sent = sent + to_send) 
     {
       /* Calculate number of bytes to send */
-      to_send = MIN(size, IFD_TOWITOKO_MAX_TRANSMIT);
+      to_send = MIN(size - sent, IFD_TOWITOKO_MAX_TRANSMIT);
 
-      /* Send  header */
+      /* Build header */
       header[1] = (BYTE) to_send;
 
-      IFD_Towitoko_PrepareCommand (ifd, header, 4);
+      length = IFD_Towitoko_FrameCommand (ifd, header, 4, frame);
+      ifd->io->stats.ifd_commands++;
 
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, (s?6:4), header))
-        return IFD_TOWITOKO_IO_ERROR;
+      if (s)
+        {
+          frame[length++] = 0xFE;
+          frame[length++] = 0xF8;
+        }
 
-      /* Send data */
-      if ((sent == 0) && (block_delay != char_delay))
-	{
-          if (!IO_Serial_Write (ifd->io, block_delay, 1, buffer))
-            return IFD_TOWITOKO_IO_ERROR;
-	  
-          if (!IO_Serial_Write (ifd->io, char_delay, to_send-1, buffer+1))
+      /* Header and data in the same write when no pacing is needed */
+      if ((char_delay == 0) && ((sent > 0) || (block_delay == 0)))
+        {
+          memcpy (frame + length, buffer + sent, to_send);
+
+          if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, length + to_send, frame))
             return IFD_TOWITOKO_IO_ERROR;
+
+          continue;
         }
-      else
-	{
-          if (!IO_Serial_Write (ifd->io, char_delay, to_send, buffer+sent))
-            return IFD_TOWITOKO_IO_ERROR;
-	}
+
+      /* Send  header */
+      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, length, frame))
+        return IFD_TOWITOKO_IO_ERROR;
+
+      /* Send data, block guard time before the first byte of the block */
+      if (!IO_Serial_WritePaced (ifd->io, (sent == 0) ? block_delay : char_delay, char_delay, to_send, buffer + sent))
+        return IFD_TOWITOKO_IO_ERROR;
     }
 
   return IFD_TOWITOKO_OK;
@@ -699,9 +847,9 @@ IFD_Towitoko_Receive (IFD * ifd, IFD_Timings * timings, unsigned size, BYTE * bu
   if (ifd->type == IFD_TOWITOKO_KARTENZWERG)
     return IFD_TOWITOKO_UNSUPPORTED;
 
-  /* Calculate timeouts */
-  char_timeout = IFD_TOWITOKO_TIMEOUT + timings->char_timeout;
-  block_timeout = IFD_TOWITOKO_TIMEOUT + timings->block_timeout;
+  /* Calculate timeouts (ms), default ones until the card timings are known */
+  char_timeout = IFD_Towitoko_GetTimeout (timings->char_timeout, IFD_TOWITOKO_CHAR_MARGIN);
+  block_timeout = IFD_Towitoko_GetTimeout (timings->block_timeout, IFD_TOWITOKO_BLOCK_MARGIN);
 
   if (block_timeout != char_timeout)
     {
@@ -760,9 +908,7 @@ extern int IFD_Towitoko_ResetSyncICC (IFD * ifd, ATR_Sync ** atr)
   BYTE buffer[5] = {0x70, 0x80, 0x62, 0x0F, 0x00};
   BYTE atr_buffer[8], status[1];
   
-  IFD_Towitoko_PrepareCommand (ifd, buffer, 5);
-
-  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 5, buffer))
+  if (!IFD_Towitoko_SendCommand (ifd, buffer, 5))
     return IFD_TOWITOKO_IO_ERROR;
 
   if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -807,9 +953,7 @@ IFD_Towitoko_SetReadAddress (IFD * ifd, int icc_type, unsigned short address)
       i2cShort[4] = LO (address);
       i2cShort[7] = (HI (address) << 1) | 0xA0 | 0x01;
   
-      IFD_Towitoko_PrepareCommand (ifd, i2cShort, 10);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 10, i2cShort))
+      if (!IFD_Towitoko_SendCommand (ifd, i2cShort, 10))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -827,9 +971,7 @@ IFD_Towitoko_SetReadAddress (IFD * ifd, int icc_type, unsigned short address)
       i2cLong[4] = HI (address);
       i2cLong[5] = LO (address);
 
-      IFD_Towitoko_PrepareCommand (ifd, i2cLong, 11);
-      
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 11, i2cLong))
+      if (!IFD_Towitoko_SendCommand (ifd, i2cLong, 11))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -846,9 +988,7 @@ IFD_Towitoko_SetReadAddress (IFD * ifd, int icc_type, unsigned short address)
 
       w2[4] = LO (address);
 
-      IFD_Towitoko_PrepareCommand (ifd, w2, 9);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 9, w2))
+      if (!IFD_Towitoko_SendCommand (ifd, w2, 9))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -866,9 +1006,7 @@ IFD_Towitoko_SetReadAddress (IFD * ifd, int icc_type, unsigned short address)
       w3[3] = (HI (address) << 6) | 0x0E;
       w3[4] = LO (address);
 
-      IFD_Towitoko_PrepareCommand (ifd, w3, 10);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 10, w3))
+      if (!IFD_Towitoko_SendCommand (ifd, w3, 10))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -901,9 +1039,7 @@ IFD_Towitoko_SetWriteAddress (IFD * ifd, int icc_type, unsigned short address, B
 #ifdef DEBUG_IFD
       printf ("IFD: I2C short set write address: %d\n", address);
 #endif
-      IFD_Towitoko_PrepareCommand (ifd, i2cShort1, 10);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 10, i2cShort1))
+      if (!IFD_Towitoko_SendCommand (ifd, i2cShort1, 10))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -912,9 +1048,7 @@ IFD_Towitoko_SetWriteAddress (IFD * ifd, int icc_type, unsigned short address, B
       if (status[0] != 0x01)
 	return IFD_TOWITOKO_CHK_ERROR;
 
-      IFD_Towitoko_PrepareCommand (ifd, i2cShort2, 3);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 3, i2cShort2))
+      if (!IFD_Towitoko_SendCommand (ifd, i2cShort2, 3))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 2, status))
@@ -924,9 +1058,7 @@ IFD_Towitoko_SetWriteAddress (IFD * ifd, int icc_type, unsigned short address, B
       i2cShort3[4] = (HI (address) << 1) | 0xA0;
       i2cShort3[5] = pagemode;
 
-      IFD_Towitoko_PrepareCommand (ifd, i2cShort3, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, i2cShort3))
+      if (!IFD_Towitoko_SendCommand (ifd, i2cShort3, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -940,9 +1072,7 @@ IFD_Towitoko_SetWriteAddress (IFD * ifd, int icc_type, unsigned short address, B
 #ifdef DEBUG_IFD
       printf ("IFD: I2C long set write address: %d\n", address);
 #endif
-      IFD_Towitoko_PrepareCommand (ifd, i2cLong1, 11);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 11, i2cLong1))
+      if (!IFD_Towitoko_SendCommand (ifd, i2cLong1, 11))
 	return IFD_TOWITOKO_CHK_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -951,9 +1081,7 @@ IFD_Towitoko_SetWriteAddress (IFD * ifd, int icc_type, unsigned short address, B
       if (status[0] != 0x01)
 	return IFD_TOWITOKO_CHK_ERROR;
 
-      IFD_Towitoko_PrepareCommand (ifd, i2cLong2, 3);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 3, i2cLong2))
+      if (!IFD_Towitoko_SendCommand (ifd, i2cLong2, 3))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 2, status))
@@ -962,9 +1090,7 @@ IFD_Towitoko_SetWriteAddress (IFD * ifd, int icc_type, unsigned short address, B
       i2cLong3[3] = LO (address);
       i2cLong3[4] = HI (address);
 
-      IFD_Towitoko_PrepareCommand (ifd, i2cLong3, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, i2cLong3))
+      if (!IFD_Towitoko_SendCommand (ifd, i2cLong3, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -981,9 +1107,7 @@ IFD_Towitoko_SetWriteAddress (IFD * ifd, int icc_type, unsigned short address, B
 
       w2[2] = LO (address);
 
-      IFD_Towitoko_PrepareCommand (ifd, w2, 7);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 7, w2))
+      if (!IFD_Towitoko_SendCommand (ifd, w2, 7))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1001,9 +1125,7 @@ IFD_Towitoko_SetWriteAddress (IFD * ifd, int icc_type, unsigned short address, B
       w3[3] = LO (address);
       w3[4] = (HI (address) << 6) | 0x33;
 
-      IFD_Towitoko_PrepareCommand (ifd, w3, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, w3))
+      if (!IFD_Towitoko_SendCommand (ifd, w3, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1029,9 +1151,7 @@ IFD_Towitoko_ReadBuffer (IFD * ifd, unsigned length, BYTE * data)
 
   for (pointer = 0; pointer < blocks_length; pointer += IFD_TOWITOKO_PS)
     {
-      IFD_Towitoko_PrepareCommand (ifd, buffer, 2);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 2, buffer))
+      if (!IFD_Towitoko_SendCommand (ifd, buffer, 2))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT,
@@ -1046,9 +1166,7 @@ IFD_Towitoko_ReadBuffer (IFD * ifd, unsigned length, BYTE * data)
     {
       buffer[0] = ((BYTE) ((length % IFD_TOWITOKO_PS) - 1)) | 0x10;
 
-      IFD_Towitoko_PrepareCommand (ifd, buffer, 2);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 2, buffer))
+      if (!IFD_Towitoko_SendCommand (ifd, buffer, 2))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT,
@@ -1082,9 +1200,7 @@ IFD_Towitoko_WriteBuffer (IFD * ifd, unsigned length, BYTE * data)
     {
       memcpy (buffer + 1, data + pointer, IFD_TOWITOKO_PS);
       
-      IFD_Towitoko_PrepareCommand (ifd, buffer, IFD_TOWITOKO_PS + 2);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, IFD_TOWITOKO_PS + 2, buffer))
+      if (!IFD_Towitoko_SendCommand (ifd, buffer, IFD_TOWITOKO_PS + 2))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1102,9 +1218,7 @@ IFD_Towitoko_WriteBuffer (IFD * ifd, unsigned length, BYTE * data)
       memcpy (buffer + 1, data + pointer, remaining_length);
       buffer[remaining_length + 1] = 0x0F;
       
-      IFD_Towitoko_PrepareCommand (ifd, buffer, remaining_length + 3);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, remaining_length + 3, buffer))
+      if (!IFD_Towitoko_SendCommand (ifd, buffer, remaining_length + 3))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1135,9 +1249,7 @@ IFD_Towitoko_ReadErrorCounter (IFD * ifd, int icc_type, unsigned *trials)
 
   if (icc_type == IFD_TOWITOKO_2W)
     {
-      IFD_Towitoko_PrepareCommand (ifd, w21, 9);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 9, w21))
+      if (!IFD_Towitoko_SendCommand (ifd, w21, 9))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1146,9 +1258,7 @@ IFD_Towitoko_ReadErrorCounter (IFD * ifd, int icc_type, unsigned *trials)
       if (status[0] != 0x01)
 	return IFD_TOWITOKO_CHK_ERROR;
 
-      IFD_Towitoko_PrepareCommand (ifd, w22, 2);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 2, w22))
+      if (!IFD_Towitoko_SendCommand (ifd, w22, 2))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 5, status))
@@ -1162,9 +1272,7 @@ IFD_Towitoko_ReadErrorCounter (IFD * ifd, int icc_type, unsigned *trials)
     }
   else if (icc_type == IFD_TOWITOKO_3W)
     {
-      IFD_Towitoko_PrepareCommand (ifd, w31, 10);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 10, w31))
+      if (!IFD_Towitoko_SendCommand (ifd, w31, 10))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1173,9 +1281,7 @@ IFD_Towitoko_ReadErrorCounter (IFD * ifd, int icc_type, unsigned *trials)
       if (status[0] != 0x01)
 	return IFD_TOWITOKO_CHK_ERROR;
 
-      IFD_Towitoko_PrepareCommand (ifd, w32, 2);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 2, w32))
+      if (!IFD_Towitoko_SendCommand (ifd, w32, 2))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 2, status))
@@ -1206,9 +1312,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 #ifdef DEBUG_IFD
       printf ("IFD: 2W enter pin: %X %X %X\n", pin[0], pin[1], pin[2]);
 #endif
-      IFD_Towitoko_PrepareCommand (ifd, w21, 7);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 7, w21))
+      if (!IFD_Towitoko_SendCommand (ifd, w21, 7))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1219,9 +1323,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 
       w22[1] = (trial == 3) ? 0x06 : (trial == 2) ? 0x04 : 0x00;
 
-      IFD_Towitoko_PrepareCommand (ifd, w22, 4);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 4, w22))
+      if (!IFD_Towitoko_SendCommand (ifd, w22, 4))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1233,9 +1335,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
       w21[2] = 0x01;
       w21[3] = 0x33;
 
-      IFD_Towitoko_PrepareCommand (ifd, w21, 7);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 7, w21))
+      if (!IFD_Towitoko_SendCommand (ifd, w21, 7))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1246,9 +1346,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 
       memcpy (w23 + 1, pin, IFD_TOWITOKO_PIN_SIZE);
 
-      IFD_Towitoko_PrepareCommand (ifd, w23, 6);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 6, w23))
+      if (!IFD_Towitoko_SendCommand (ifd, w23, 6))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1257,9 +1355,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
       w21[2] = 0x00;
       w21[3] = 0x39;
 
-      IFD_Towitoko_PrepareCommand (ifd, w21, 7);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 7, w21))
+      if (!IFD_Towitoko_SendCommand (ifd, w21, 7))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1270,9 +1366,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 
       w22[1] = 0xFF;
 
-      IFD_Towitoko_PrepareCommand (ifd, w22, 4);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 4, w22))
+      if (!IFD_Towitoko_SendCommand (ifd, w22, 4))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1287,9 +1381,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 #ifdef DEBUG_IFD
       printf ("IFD: 3W enter pin: %X %X\n", pin[0], pin[1]);
 #endif
-      IFD_Towitoko_PrepareCommand (ifd, w31, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, w31))
+      if (!IFD_Towitoko_SendCommand (ifd, w31, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1305,9 +1397,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 	(trial == 4) ? 0xE0 :
 	(trial == 3) ? 0xC0 : (trial == 2) ? 0x80 : 0x00;
 
-      IFD_Towitoko_PrepareCommand (ifd, w32, 4);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 4, w32))
+      if (!IFD_Towitoko_SendCommand (ifd, w32, 4))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1319,9 +1409,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
       w31[3] = 0xFE;
       w31[4] = 0xCD;
 
-      IFD_Towitoko_PrepareCommand (ifd, w31, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, w31))
+      if (!IFD_Towitoko_SendCommand (ifd, w31, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1332,9 +1420,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 
       w32[1] = pin[0];
 
-      IFD_Towitoko_PrepareCommand (ifd, w32, 4);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 4, w32))
+      if (!IFD_Towitoko_SendCommand (ifd, w32, 4))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1344,9 +1430,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 	return IFD_TOWITOKO_CHK_ERROR;
 
       w31[3] = 0xFF;
-      IFD_Towitoko_PrepareCommand (ifd, w31, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, w31))
+      if (!IFD_Towitoko_SendCommand (ifd, w31, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1357,9 +1441,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 
       w32[1] = pin[1];
 
-      IFD_Towitoko_PrepareCommand (ifd, w32, 4);
-      
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 4, w32))
+      if (!IFD_Towitoko_SendCommand (ifd, w32, 4))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1371,9 +1453,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
       w31[3] = 0xFD;
       w31[4] = 0xF3;
 
-      IFD_Towitoko_PrepareCommand (ifd, w31, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, w31))
+      if (!IFD_Towitoko_SendCommand (ifd, w31, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1384,9 +1464,7 @@ IFD_Towitoko_EnterPin (IFD * ifd, int icc_type, BYTE * pin, unsigned trial)
 
       w32[1] = 0xFF;
 
-      IFD_Towitoko_PrepareCommand (ifd, w32, 4);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 4, w32))
+      if (!IFD_Towitoko_SendCommand (ifd, w32, 4))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1415,9 +1493,7 @@ IFD_Towitoko_ChangePin (IFD * ifd, int icc_type, BYTE * pin)
 #ifdef DEBUG_IFD
       printf ("IFD: 2W change pin: %X %X %X\n", pin[0], pin[1], pin[2]);
 #endif
-      IFD_Towitoko_PrepareCommand (ifd, w21, 7);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 7, w21))
+      if (!IFD_Towitoko_SendCommand (ifd, w21, 7))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1430,9 +1506,7 @@ IFD_Towitoko_ChangePin (IFD * ifd, int icc_type, BYTE * pin)
       w22[2] = pin[1];
       w22[3] = pin[2];
 
-      IFD_Towitoko_PrepareCommand (ifd, w22, 6);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 6, w22))
+      if (!IFD_Towitoko_SendCommand (ifd, w22, 6))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1447,9 +1521,7 @@ IFD_Towitoko_ChangePin (IFD * ifd, int icc_type, BYTE * pin)
 #ifdef DEBUG_IFD
       printf ("IFD: 3W change pin: %X %X\n", pin[0], pin[1]);
 #endif
-      IFD_Towitoko_PrepareCommand (ifd, w31, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, w31))
+      if (!IFD_Towitoko_SendCommand (ifd, w31, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1460,9 +1532,7 @@ IFD_Towitoko_ChangePin (IFD * ifd, int icc_type, BYTE * pin)
 
       w32[1] = pin[0];
 
-      IFD_Towitoko_PrepareCommand (ifd, w32, 4);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 4, w32))
+      if (!IFD_Towitoko_SendCommand (ifd, w32, 4))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1473,9 +1543,7 @@ IFD_Towitoko_ChangePin (IFD * ifd, int icc_type, BYTE * pin)
 
       w31[3] = 0xFF;
 
-      IFD_Towitoko_PrepareCommand (ifd, w31, 8);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 8, w31))
+      if (!IFD_Towitoko_SendCommand (ifd, w31, 8))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1486,9 +1554,7 @@ IFD_Towitoko_ChangePin (IFD * ifd, int icc_type, BYTE * pin)
 
       w32[1] = pin[1];
       
-      IFD_Towitoko_PrepareCommand (ifd, w32, 4);
-
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 4, w32))
+      if (!IFD_Towitoko_SendCommand (ifd, w32, 4))
 	return IFD_TOWITOKO_IO_ERROR;
 
       if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 1, status))
@@ -1579,31 +1645,53 @@ IFD_Towitoko_GetMaxBaudrate (IFD * ifd)
  * Not exported funcions definition
  */
 
-static int
-IFD_Towitoko_PrepareCommand (IFD * ifd, BYTE * command, BYTE size)
+static unsigned
+IFD_Towitoko_FrameCommand (IFD * ifd, BYTE * command, BYTE size, BYTE * frame)
 {
   IO_Serial_Properties props;
-  BYTE buffer[1], initial;
-
-  if (!IO_Serial_GetProperties (ifd->io, &props))
-    return IFD_TOWITOKO_IO_ERROR;
+  unsigned length = 0;
+  BYTE initial;
 
-  if (props.output_bitrate >= 115200L)
+  /* Length prefix is part of the frame at high speed */
+  if (IO_Serial_GetProperties (ifd->io, &props) &&
+      (props.output_bitrate >= 115200L))
     {
-      buffer[0] = size - 1;
-      
-      if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 1, buffer))
-        return IFD_TOWITOKO_IO_ERROR;
-
-      initial = IFD_Towitoko_Checksum(buffer, 1, ifd->slot);
+      frame[length++] = size - 1;
+      initial = IFD_Towitoko_Checksum (frame, 1, ifd->slot);
     }
 
   else
     initial = ifd->slot;
 
-  command[size-1] = IFD_Towitoko_Checksum(command, size-1, initial);
+  command[size-1] = IFD_Towitoko_Checksum (command, size-1, initial);
+  memcpy (frame + length, command, size);
 
-  return IFD_TOWITOKO_OK;
+  return length + size;
+}
+
+static unsigned
+IFD_Towitoko_GetTimeout (unsigned long timeout, unsigned margin)
+{
+  if (timeout == 0)
+    return IFD_TOWITOKO_TIMEOUT;
+
+  /* Round up to the millisecond resolution of the serial port */
+  return (unsigned) ((timeout + 999) / 1000) + margin;
+}
+
+static bool
+IFD_Towitoko_SendCommand (IFD * ifd, BYTE * command, BYTE size)
+{
+  BYTE frame[IFD_TOWITOKO_MAX_FRAME];
+  unsigned length;
+
+  IO_SERIAL_TRACE (ifd->io, IO_SERIAL_TRACE_COMMAND, size, command);
+  ifd->io->stats.ifd_commands++;
+
+  /* Length prefix, command and checksum go out in a single write */
+  length = IFD_Towitoko_FrameCommand (ifd, command, size, frame);
+
+  return IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, length, frame);
 }
 
 static BYTE
@@ -1624,35 +1712,6 @@ IFD_Towitoko_Checksum (BYTE * command, unsigned size, BYTE initial)
   return checksum;
 }
 
-static int
-IFD_Towitoko_GetReaderInfo (IFD * ifd)
-{
-  BYTE status[3];
-  BYTE buffer[2] = { 0x00, 0x01};
-
-  buffer[1] = IFD_Towitoko_Checksum (buffer, 1, ifd->slot);
-  
-  if (!IO_Serial_Write (ifd->io, IFD_TOWITOKO_DELAY, 2, buffer))
-    return IFD_TOWITOKO_IO_ERROR;
-
-  if (!IO_Serial_Read (ifd->io, IFD_TOWITOKO_TIMEOUT, 3, status))
-    return IFD_TOWITOKO_IO_ERROR;
-
-  ifd->type = status[0];
-  ifd->firmware = status[1];
-
-#ifdef DEBUG_IFD
-  printf ("IFD: Reader type = %s\n",
-	  status[0] == IFD_TOWITOKO_CHIPDRIVE_EXT_II ? "Chipdrive Extern II" :
-	  status[0] == IFD_TOWITOKO_CHIPDRIVE_EXT_I ? "Chipdrive Extern I" :
-	  status[0] == IFD_TOWITOKO_CHIPDRIVE_INT ? "Chipdrive Intern" :
-	  status[0] == IFD_TOWITOKO_CHIPDRIVE_MICRO ? "Chipdrive Micro" :
-	  status[0] == IFD_TOWITOKO_KARTENZWERG_II ? "Kartenzwerg II" :
-	  status[0] == IFD_TOWITOKO_KARTENZWERG ? "Kartenzwerg" : "Unknown");
-#endif
-  
-  return IFD_TOWITOKO_OK;
-}
 
 static unsigned
 IFD_Towitoko_NumTrials (BYTE b)
@@ -1675,4 +1734,5 @@ IFD_Towitoko_Clear (IFD * ifd)
   ifd->slot = 0x00;
   ifd->type = 0x00;
   ifd->firmware = 0x00;
+  ifd->parity = 0;
 }
@@ -88,10 +88,10 @@
 
 typedef struct
 {
-  unsigned block_delay;		/* Delay (ms) after starting to transmit */
-  unsigned char_delay;		/* Delay (ms) after transmiting sucesive chars */
-  unsigned block_timeout;	/* Max timeout (ms) to receive firtst char */
-  unsigned char_timeout;	/* Max timeout (ms) to receive sucesive characters */
+  unsigned long block_delay;	/* Delay (us) after starting to transmit */
+  unsigned long char_delay;	/* Delay (us) after transmiting sucesive chars */
+  unsigned long block_timeout;	/* Max timeout (us) to receive firtst char, 0 if unknown */
+  unsigned long char_timeout;	/* Max timeout (us) to receive sucesive characters, 0 if unknown */
 }
 IFD_Timings;
 
@@ -102,6 +102,7 @@ typedef struct
   BYTE slot;			/* Chipdrive Twin Slot */
   BYTE type;			/* Reader type code */
   BYTE firmware;		/* Reader firmware version */
+  BYTE parity;			/* Parity last set in the reader, 0 if unknown */
 }
 IFD_Towitoko;
 
@@ -123,8 +124,12 @@ extern int IFD_Towitoko_Close (IFD * ifd);
 extern int IFD_Towitoko_SetBaudrate (IFD * ifd, unsigned long baudrate);
 extern int IFD_Towitoko_GetBaudrate (IFD * ifd, unsigned long *baudrate);
 extern int IFD_Towitoko_SetParity (IFD * ifd, BYTE parity);
+extern void IFD_Towitoko_ForgetParity (IFD * ifd);
 extern int IFD_Towitoko_SetLED (IFD * ifd, BYTE color);
 extern int IFD_Towitoko_GetStatus (IFD * ifd, BYTE * status);
+extern int IFD_Towitoko_WaitStatus (IFD * ifd, unsigned timeout);
+extern int IFD_Towitoko_GetReaderInfo (IFD * ifd);
+extern int IFD_Towitoko_Restore (IFD * ifd, bool * reset);
 
 /* General handling of ICC inserted in this IFD */
 extern int IFD_Towitoko_ActivateICC (IFD * ifd);
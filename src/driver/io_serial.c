@@ -36,11 +36,50 @@
 #include <sys/time.h>
 #endif
 #include <sys/ioctl.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #include <time.h>
+#include <errno.h>
 #include "io_serial.h"
 
 #define IO_SERIAL_FILENAME_LENGTH 	32
 
+/* Modem lines that signal card insertion and removal, TIOCM_CD for example */
+#ifndef IO_SERIAL_DETECT_LINES
+#define IO_SERIAL_DETECT_LINES		0
+#endif
+
+/* Environment variable that enables tracing, and file to dump it on close */
+#define IO_SERIAL_TRACE_ENV		"TOWITOKO_TRACE"
+
+/* Identification of trace dump files */
+#define IO_SERIAL_TRACE_MAGIC		"TWTR"
+#define IO_SERIAL_TRACE_HEADER_SIZE	12
+#define IO_SERIAL_TRACE_FILENAME_LENGTH	256
+
+/* Number of events in the header of a file still being recorded */
+#define IO_SERIAL_TRACE_UNTIL_EOF	0xFFFFFFFF
+
+/* Environment variables to record a session, or replay one instead of the device */
+#define IO_SERIAL_RECORD_ENV		"TOWITOKO_RECORD"
+#define IO_SERIAL_REPLAY_ENV		"TOWITOKO_REPLAY"
+#define IO_SERIAL_REPLAY_REALTIME_ENV	"TOWITOKO_REPLAY_REALTIME"
+
+/* Interval (ms) between samples of the card detect lines */
+#ifndef IO_SERIAL_DETECT_INTERVAL
+#define IO_SERIAL_DETECT_INTERVAL	5
+#endif
+
+/* Time (ms) a USB-serial device node may take to come back, and interval between attempts */
+#ifndef IO_SERIAL_REOPEN_TIMEOUT
+#define IO_SERIAL_REOPEN_TIMEOUT	1000
+#endif
+
+#ifndef IO_SERIAL_REOPEN_INTERVAL
+#define IO_SERIAL_REOPEN_INTERVAL	20
+#endif
+
 /*
  * Internal functions declaration
  */
@@ -49,10 +88,19 @@ static int
 IO_Serial_Bitrate(int bitrate);
 
 static bool
-IO_Serial_WaitToRead (int hnd, unsigned delay_ms, unsigned timeout_ms);
+IO_Serial_WaitToRead (int hnd, int cancel, unsigned delay_ms, unsigned timeout_ms);
 
-static bool 
-IO_Serial_WaitToWrite (int hnd, unsigned delay_ms, unsigned timeout_ms);
+static bool
+IO_Serial_WaitToWrite (int hnd, int cancel, unsigned delay_ms, unsigned timeout_ms);
+
+static void
+IO_Serial_Sleep (unsigned delay_ms);
+
+static void
+IO_Serial_SleepUntil (struct timespec *deadline);
+
+static void
+IO_Serial_AddTime (struct timespec *ts, unsigned long delay_us);
 
 static void 
 IO_Serial_DeviceName (unsigned com, bool usbserial, char * filename, unsigned length);
@@ -60,6 +108,9 @@ IO_Serial_DeviceName (unsigned com, bool usbserial, char * filename, unsigned le
 static bool 
 IO_Serial_InitPnP (IO_Serial * io);
 
+static bool
+IO_Serial_IsGone (IO_Serial * io, int error);
+
 static void 
 IO_Serial_Clear (IO_Serial * io);
 
@@ -72,6 +123,33 @@ IO_Serial_SetPropertiesCache(IO_Serial * io, IO_Serial_Properties * props);
 static void
 IO_Serial_ClearPropertiesCache (IO_Serial * io);
 
+static unsigned long
+IO_Serial_TraceNext (IO_Serial_TraceBuffer * trace);
+
+static bool
+IO_Serial_InitRecord (IO_Serial * io, const char * name);
+
+static void
+IO_Serial_CloseRecord (IO_Serial * io);
+
+static bool
+IO_Serial_InitReplay (IO_Serial * io, const char * filename);
+
+static void
+IO_Serial_CloseReplay (IO_Serial * io);
+
+static IO_Serial_TraceEvent *
+IO_Serial_ReplayEvent (IO_Serial_Replay * replay);
+
+static bool
+IO_Serial_ReplayRead (IO_Serial * io, unsigned size, BYTE * data);
+
+static bool
+IO_Serial_ReplayWrite (IO_Serial * io, unsigned size, BYTE * data);
+
+static bool
+IO_Serial_ReplayFail (IO_Serial * io);
+
 /*
  * Public functions definition
  */
@@ -92,6 +170,7 @@ IO_Serial_New (void)
 bool IO_Serial_Init (IO_Serial * io, unsigned com, bool usbserial, bool pnp)
 {
   char filename[IO_SERIAL_FILENAME_LENGTH];
+  char *env;
 
   IO_Serial_DeviceName (com, usbserial, filename, IO_SERIAL_FILENAME_LENGTH);
 
@@ -103,10 +182,40 @@ bool IO_Serial_Init (IO_Serial * io, unsigned com, bool usbserial, bool pnp)
     return FALSE;
 
   io->com = com;
-  io->fd = open (filename, O_RDWR | O_NOCTTY);
 
-  if (io->fd < 0)
-    return FALSE;
+  /* Tracing can be enabled without rebuilding */
+  if (getenv (IO_SERIAL_TRACE_ENV) != NULL)
+    IO_Serial_SetTrace (io, TRUE);
+
+  /* A recorded session can be fed back instead of using the device */
+  env = getenv (IO_SERIAL_REPLAY_ENV);
+
+  if ((env != NULL) && (strlen (env) > 0))
+    {
+      if (!IO_Serial_InitReplay (io, env))
+	return FALSE;
+    }
+  else
+    {
+      io->fd = open (filename, O_RDWR | O_NOCTTY);
+
+      if (io->fd < 0)
+	return FALSE;
+
+      /* Without the pipe waits are still cancelled, but not woken */
+      if (pipe (io->cancel) == 0)
+	{
+	  fcntl (io->cancel[0], F_SETFL, O_NONBLOCK);
+	  fcntl (io->cancel[1], F_SETFL, O_NONBLOCK);
+	}
+      else
+	io->cancel[0] = io->cancel[1] = -1;
+
+      env = getenv (IO_SERIAL_RECORD_ENV);
+
+      if ((env != NULL) && (strlen (env) > 0))
+	IO_Serial_InitRecord (io, env);
+    }
 
   if (pnp)
     IO_Serial_InitPnP (io);
@@ -126,6 +235,10 @@ IO_Serial_GetProperties (IO_Serial * io, IO_Serial_Properties * props)
   if (IO_Serial_GetPropertiesCache(io, props))
     return TRUE;
 
+  /* Replayed sessions have no device to ask */
+  if (io->replay != NULL)
+    return FALSE;
+
   if (tcgetattr (io->fd, &currtio) != 0)
     return FALSE;
 
@@ -396,6 +509,12 @@ IO_Serial_SetProperties (IO_Serial * io, IO_Serial_Properties * props)
 {
   struct termios newtio;
   unsigned int modembits;
+
+  if (io->replay != NULL)
+    {
+      IO_Serial_SetPropertiesCache (io, props);
+      return TRUE;
+    }
 #if 1
 #if !defined(OS_CYGWIN32) && !defined(OS_HPUX)
 
@@ -537,6 +656,21 @@ IO_Serial_Read (IO_Serial * io, unsigned timeout, unsigned size, BYTE * data)
 {
   BYTE c;
   int count = 0;
+  int got, error;
+  struct timespec start;
+
+  if (io->replay != NULL)
+    return IO_Serial_ReplayRead (io, size, data);
+
+  IO_Serial_GetTime (&start);
+
+  /* Device lost by an earlier call and not back yet */
+  if ((io->fd < 0) && !IO_Serial_Reopen (io))
+    {
+      io->stats.io_errors++;
+      IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_ERROR, 0, NULL);
+      return FALSE;
+    }
 
 #ifdef DEBUG_IO
   printf ("IO: Receiving: ");
@@ -545,14 +679,30 @@ IO_Serial_Read (IO_Serial * io, unsigned timeout, unsigned size, BYTE * data)
 
   for (count = 0; count < size; count++)
     {
-      if (IO_Serial_WaitToRead (io->fd, 0, timeout))
+      if (IO_Serial_WaitToRead (io->fd, io->cancel[0], 0, timeout))
 	{
-	  if (read (io->fd, &c, 1) != 1)
+	  io->stats.io_reads++;
+
+	  got = read (io->fd, &c, 1);
+
+	  if (got != 1)
 	    {
+	      /* End of file is what a hung up device reads */
+	      error = (got == 0) ? EIO : errno;
 #ifdef DEBUG_IO
 	      printf ("ERROR\n");
 	      fflush (stdout);
 #endif
+	      io->stats.io_bytes_in += count;
+	      io->stats.io_errors++;
+	      IO_Serial_AddLatency (&(io->stats.io_read), &start);
+	      IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_IN, count, data);
+	      IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_ERROR, 0, NULL);
+
+	      /* The bytes in flight are lost, but the next call finds the device */
+	      if (IO_Serial_IsGone (io, error))
+		IO_Serial_Reopen (io);
+
 	      return FALSE;
 	    }
 	  data[count] = c;
@@ -569,6 +719,18 @@ IO_Serial_Read (IO_Serial * io, unsigned timeout, unsigned size, BYTE * data)
 	  fflush (stdout);
 #endif
 	  /* tcflush (io->fd, TCIFLUSH); */
+	  io->stats.io_bytes_in += count;
+	  IO_Serial_AddLatency (&(io->stats.io_read), &start);
+	  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_IN, count, data);
+
+	  if (io->cancelled)
+	    {
+	      IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_CANCEL, 0, NULL);
+	      return FALSE;
+	    }
+
+	  io->stats.io_timeouts++;
+	  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_TIMEOUT, 0, NULL);
 	  return FALSE;
 	}
     }
@@ -578,37 +740,110 @@ IO_Serial_Read (IO_Serial * io, unsigned timeout, unsigned size, BYTE * data)
   fflush (stdout);
 #endif
 
+  io->stats.io_bytes_in += size;
+  IO_Serial_AddLatency (&(io->stats.io_read), &start);
+  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_IN, size, data);
+
   return TRUE;
 }
 
 bool
 IO_Serial_Write (IO_Serial * io, unsigned delay, unsigned size, BYTE * data)
 {
+  return IO_Serial_WritePaced (io, delay * 1000L, delay * 1000L, size, data);
+}
+
+bool
+IO_Serial_WritePaced (IO_Serial * io, unsigned long first_delay, unsigned long char_delay, unsigned size, BYTE * data)
+{
+  struct timespec deadline, now;
+  unsigned long char_time, delay;
   unsigned count, to_send;
+  int error;
 #ifdef DEBUG_IO
   unsigned i;
+#endif
+
+  /* Replay validates the bytes, pacing does not change them */
+  if (io->replay != NULL)
+    return IO_Serial_ReplayWrite (io, size, data);
+
+  if ((io->fd < 0) && !IO_Serial_Reopen (io))
+    {
+      io->stats.io_errors++;
+      IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_ERROR, 0, NULL);
+      return FALSE;
+    }
 
+#ifdef DEBUG_IO
   printf ("IO: Sending: ");
   fflush (stdout);
 #endif
   /* Discard input data from previous commands */
   tcflush (io->fd, TCIFLUSH);
 
+  /* The UART cannot send characters closer than one frame apart */
+  char_time = IO_Serial_GetCharTime (io);
+
+  if (first_delay <= char_time)
+    first_delay = 0;
+
+  if (char_delay <= char_time)
+    char_delay = 0;
+
+  /* Deadlines are absolute, so time spent in write() does not accumulate */
+  if (first_delay > 0 || char_delay > 0)
+    IO_Serial_GetTime (&deadline);
+
   for (count = 0; count < size; count += to_send)
     {
-      to_send = (delay? 1: size);
+      delay = (count == 0 ? first_delay : char_delay);
 
-      if (IO_Serial_WaitToWrite (io->fd, delay, 1000))
+      /* Paced characters are written one by one, the rest all at once */
+      if ((char_delay > 0) || (count == 0 && first_delay > 0))
+        to_send = 1;
+      else
+        to_send = size - count;
+
+      if (delay > 0)
+        {
+          IO_Serial_AddTime (&deadline, delay);
+          IO_Serial_SleepUntil (&deadline);
+        }
+
+      if (IO_Serial_WaitToWrite (io->fd, io->cancel[0], 0, 1000))
 	{
+	  io->stats.io_writes++;
+
 	  if (write (io->fd, data + count, to_send) != to_send)
 	    {
+	      error = errno;
 #ifdef DEBUG_IO
 	      printf ("ERROR\n");
 	      fflush (stdout);
 #endif
+	      io->stats.io_errors++;
+	      IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_ERROR, 0, NULL);
+
+	      if (IO_Serial_IsGone (io, error))
+		IO_Serial_Reopen (io);
+
 	      return FALSE;
 	    }
 
+	  io->stats.io_bytes_out += to_send;
+	  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_OUT, to_send, data + count);
+
+	  /* The next delay counts from now if late, so late bytes keep their spacing */
+	  if (char_delay > 0)
+	    {
+	      IO_Serial_GetTime (&now);
+
+	      if ((now.tv_sec > deadline.tv_sec) ||
+		  ((now.tv_sec == deadline.tv_sec) && (now.tv_nsec > deadline.tv_nsec)))
+		deadline = now;
+	    }
+
 #ifdef DEBUG_IO
 	  for (i=0; i<to_send; i++)
 	    printf ("%X ", data[count + i]);
@@ -622,6 +857,14 @@ IO_Serial_Write (IO_Serial * io, unsigned delay, unsigned size, BYTE * data)
 	  fflush (stdout);
 #endif
 	  /* tcflush (io->fd, TCIFLUSH); */
+	  if (io->cancelled)
+	    {
+	      IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_CANCEL, 0, NULL);
+	      return FALSE;
+	    }
+
+	  io->stats.io_timeouts++;
+	  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_TIMEOUT, 0, NULL);
 	  return FALSE;
 	}
     }
@@ -634,9 +877,29 @@ IO_Serial_Write (IO_Serial * io, unsigned delay, unsigned size, BYTE * data)
   return TRUE;
 }
 
+unsigned long
+IO_Serial_GetCharTime (IO_Serial * io)
+{
+  IO_Serial_Properties props;
+  unsigned frame;
+
+  if (!IO_Serial_GetProperties (io, &props) || props.output_bitrate == 0)
+    return 0;
+
+  /* Start bit, data bits, parity bit and stop bits */
+  frame = 1 + props.bits + props.stopbits;
+
+  if (props.parity != IO_SERIAL_PARITY_NONE)
+    frame++;
+
+  return (frame * 1000000L) / props.output_bitrate;
+}
+
 bool IO_Serial_Close (IO_Serial * io)
 {
   char filename[IO_SERIAL_FILENAME_LENGTH];
+  char trace_file[IO_SERIAL_TRACE_FILENAME_LENGTH];
+  char *env;
 
  IO_Serial_DeviceName (io->com, io->usbserial, filename,
  IO_SERIAL_FILENAME_LENGTH);
@@ -645,21 +908,359 @@ bool IO_Serial_Close (IO_Serial * io)
   printf ("IO: Clossing serial port %s\n", filename);
 #endif
 
-  if (close (io->fd) != 0)
+  if (io->replay != NULL)
+    IO_Serial_CloseReplay (io);
+
+  else if ((io->fd >= 0) && (close (io->fd) != 0))
     return FALSE;
 
+  if (io->cancel[0] >= 0)
+    {
+      close (io->cancel[0]);
+      close (io->cancel[1]);
+    }
+
+  if (io->record != NULL)
+    IO_Serial_CloseRecord (io);
+
+  /* Dump trace to the file named in the environment, one per port */
+  if (io->trace != NULL)
+    {
+      env = getenv (IO_SERIAL_TRACE_ENV);
+
+      if ((env != NULL) && (strlen (env) > 0))
+	{
+	  snprintf (trace_file, IO_SERIAL_TRACE_FILENAME_LENGTH, "%s.%u", env, io->com);
+	  IO_Serial_DumpTrace (io, trace_file);
+	}
+
+      free (io->trace);
+    }
+
   IO_Serial_ClearPropertiesCache (io);
   IO_Serial_Clear (io);
 
   return TRUE;
 }
 
+bool
+IO_Serial_Reopen (IO_Serial * io)
+{
+  char filename[IO_SERIAL_FILENAME_LENGTH];
+  IO_Serial_Properties props;
+  unsigned elapsed;
+
+  if (io->replay != NULL)
+    return FALSE;
+
+  IO_Serial_DeviceName (io->com, io->usbserial, filename, IO_SERIAL_FILENAME_LENGTH);
+
+#ifdef DEBUG_IO
+  printf ("IO: Reopening serial port %s\n", filename);
+#endif
+
+  if (io->fd >= 0)
+    {
+      close (io->fd);
+      io->fd = -1;
+    }
+
+  /* The node comes back once the adapter is enumerated again */
+  for (elapsed = 0; (io->fd = open (filename, O_RDWR | O_NOCTTY)) < 0; elapsed += IO_SERIAL_REOPEN_INTERVAL)
+    {
+      if ((elapsed >= IO_SERIAL_REOPEN_TIMEOUT) || io->cancelled)
+	return FALSE;
+
+      IO_Serial_Sleep (IO_SERIAL_REOPEN_INTERVAL);
+    }
+
+  io->stats.io_reopens++;
+
+  /* The cache outlives the handle, so the settings are applied again */
+  if (IO_Serial_GetPropertiesCache (io, &props))
+    return IO_Serial_SetProperties (io, &props);
+
+  return TRUE;
+}
+
+bool
+IO_Serial_WaitLines (IO_Serial * io, unsigned timeout)
+{
+#if IO_SERIAL_DETECT_LINES != 0
+  int initial, mctl;
+  unsigned elapsed, delay;
+
+  /* 
+   * TIOCMIWAIT cannot time out, so sample the lines instead. TIOCMGET
+   * does not go to the wire, the line status is kept by the kernel
+   */
+  if (ioctl (io->fd, TIOCMGET, &initial) >= 0)
+    {
+      for (elapsed = 0; elapsed < timeout; elapsed += delay)
+	{
+	  delay = MIN (IO_SERIAL_DETECT_INTERVAL, timeout - elapsed);
+	  IO_Serial_Sleep (delay);
+
+	  if (io->cancelled)
+	    return FALSE;
+
+	  if (ioctl (io->fd, TIOCMGET, &mctl) < 0)
+	    break;
+
+	  if (((mctl ^ initial) & IO_SERIAL_DETECT_LINES) != 0)
+	    {
+#ifdef DEBUG_IO
+	      printf ("IO: Card detect lines changed after %u ms\n", elapsed + delay);
+#endif
+	      return TRUE;
+	    }
+	}
+
+      return FALSE;
+    }
+#endif
+
+  /* Reader does not signal card status: just wait, unless cancelled */
+  if (!io->cancelled)
+    IO_Serial_Sleep (timeout);
+
+  return FALSE;
+}
+
+void
+IO_Serial_Cancel (IO_Serial * io)
+{
+  BYTE c = 0;
+
+  io->cancelled = TRUE;
+
+  /* Wakes the wait in progress, the byte stays until reset */
+  if (io->cancel[1] >= 0)
+    (void) (write (io->cancel[1], &c, 1) < 0);
+}
+
+bool
+IO_Serial_IsCancelled (IO_Serial * io)
+{
+  return io->cancelled;
+}
+
+void
+IO_Serial_ResetCancel (IO_Serial * io)
+{
+  BYTE buffer[16];
+
+  io->cancelled = FALSE;
+
+  if (io->cancel[0] >= 0)
+    while (read (io->cancel[0], buffer, sizeof (buffer)) > 0);
+}
+
+bool
+IO_Serial_SetTrace (IO_Serial * io, bool enable)
+{
+  /* The buffer is kept when disabled, so writers never see it freed */
+  if (enable && io->trace == NULL)
+    {
+      io->trace = (IO_Serial_TraceBuffer *) calloc (1, sizeof (IO_Serial_TraceBuffer));
+
+      if (io->trace == NULL)
+	return FALSE;
+    }
+
+  io->tracing = enable;
+
+  return TRUE;
+}
+
+void
+IO_Serial_Trace (IO_Serial * io, BYTE type, unsigned size, BYTE * data)
+{
+  IO_Serial_TraceEvent event;
+  struct timespec now;
+  unsigned length;
+
+  IO_Serial_GetTime (&now);
+
+  event.sec = (unsigned int) now.tv_sec;
+  event.nsec = (unsigned int) now.tv_nsec;
+
+  /* Long data takes consecutive events, all but the last flagged MORE */
+  do
+    {
+      length = MIN (size, IO_SERIAL_TRACE_DATA);
+
+      event.type = type | ((size > length) ? IO_SERIAL_TRACE_MORE : 0);
+      event.length = (BYTE) length;
+
+      if (length > 0)
+	memcpy (event.data, data, length);
+
+      if (io->tracing)
+	memcpy (io->trace->events + (IO_Serial_TraceNext (io->trace) & (IO_SERIAL_TRACE_EVENTS - 1)), 
+		&event, sizeof (IO_Serial_TraceEvent));
+
+      if (io->record != NULL)
+	fwrite (&event, sizeof (IO_Serial_TraceEvent), 1, io->record);
+
+      data += length;
+      size -= length;
+    }
+  while (size > 0);
+}
+
+bool
+IO_Serial_DumpTrace (IO_Serial * io, const char * filename)
+{
+  FILE *file;
+  unsigned int header[2];
+  unsigned long first, head, i;
+
+  if (io->trace == NULL)
+    return FALSE;
+
+  file = fopen (filename, "wb");
+
+  if (file == NULL)
+    return FALSE;
+
+  /* Events oldest first, the ring keeps the last IO_SERIAL_TRACE_EVENTS */
+  head = io->trace->head;
+  first = (head > IO_SERIAL_TRACE_EVENTS) ? head - IO_SERIAL_TRACE_EVENTS : 0;
+
+  header[0] = (unsigned int) (head - first);
+  header[1] = (unsigned int) sizeof (IO_Serial_TraceEvent);
+
+  fwrite (IO_SERIAL_TRACE_MAGIC, 1, 4, file);
+  fwrite (header, sizeof (unsigned int), 2, file);
+
+  for (i = first; i < head; i++)
+    fwrite (io->trace->events + (i & (IO_SERIAL_TRACE_EVENTS - 1)), sizeof (IO_Serial_TraceEvent), 1, file);
+
+  return (fclose (file) == 0);
+}
+
+bool
+IO_Serial_PrintTrace (const char * filename, FILE * output)
+{
+  static const char *names[] = 
+    { "?", "OUT", "IN", "TIMEOUT", "ERROR", "COMMAND", "BLOCK OUT", "BLOCK IN", "CANCEL" };
+  IO_Serial_TraceEvent event;
+  unsigned int header[2], i, j;
+  double start = 0, time;
+  char magic[4];
+  bool more = FALSE;
+  FILE *file;
+  BYTE type;
+
+  file = fopen (filename, "rb");
+
+  if (file == NULL)
+    return FALSE;
+
+  if ((fread (magic, 1, 4, file) != 4) || 
+      (memcmp (magic, IO_SERIAL_TRACE_MAGIC, 4) != 0) ||
+      (fread (header, sizeof (unsigned int), 2, file) != 2) ||
+      (header[1] != sizeof (IO_Serial_TraceEvent)))
+    {
+      fclose (file);
+      return FALSE;
+    }
+
+  /* Files of sessions that did not finish recording are read to the end */
+  for (i = 0; i < header[0]; i++)
+    {
+      if (fread (&event, sizeof (IO_Serial_TraceEvent), 1, file) != 1)
+	break;
+
+      time = event.sec + event.nsec / 1000000000.0;
+
+      if (i == 0)
+	start = time;
+
+      /* Continuation events are printed on the line of the first one */
+      if (!more)
+	{
+	  type = event.type & ~IO_SERIAL_TRACE_MORE;
+	  fprintf (output, "%12.6f %-9s", time - start, 
+		   names[(type <= IO_SERIAL_TRACE_CANCEL) ? type : 0]);
+	}
+
+      for (j = 0; j < event.length && j < IO_SERIAL_TRACE_DATA; j++)
+	fprintf (output, " %02X", event.data[j]);
+
+      more = ((event.type & IO_SERIAL_TRACE_MORE) != 0);
+
+      if (!more)
+	fprintf (output, "\n");
+    }
+
+  if (more)
+    fprintf (output, "\n");
+
+  fclose (file);
+
+  return ((i == header[0]) || (header[0] == IO_SERIAL_TRACE_UNTIL_EOF));
+}
+
+void
+IO_Serial_GetTime (struct timespec *ts)
+{
+#if defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME)
+  clock_gettime (CLOCK_MONOTONIC, ts);
+#else
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  ts->tv_sec = tv.tv_sec;
+  ts->tv_nsec = tv.tv_usec * 1000L;
+#endif
+}
+
+void
+IO_Serial_AddLatency (IO_Serial_Histogram * hist, struct timespec *start)
+{
+  struct timespec now;
+  unsigned long latency;
+  unsigned bucket;
+
+  IO_Serial_GetTime (&now);
+
+  latency = (now.tv_sec - start->tv_sec) * 1000000L +
+    (now.tv_nsec - start->tv_nsec) / 1000L;
+
+  /* Bucket is the number of significant bits of the latency */
+  for (bucket = 0; (bucket < IO_SERIAL_STATS_BUCKETS - 1) && ((latency >> bucket) != 0); bucket++);
+
+  hist->count++;
+  hist->total += latency;
+  hist->buckets[bucket]++;
+
+  if (latency > hist->max)
+    hist->max = latency;
+}
+
+IO_Serial_Stats *
+IO_Serial_GetStats (IO_Serial * io)
+{
+  return &(io->stats);
+}
+
 void
 IO_Serial_Delete (IO_Serial * io)
 {
   if (io->props != NULL)
     free (io->props);
 
+  if (io->trace != NULL)
+    free (io->trace);
+
+  if (io->replay != NULL)
+    IO_Serial_CloseReplay (io);
+
+  if (io->record != NULL)
+    IO_Serial_CloseRecord (io);
+
   free (io);
 }
 
@@ -731,39 +1332,35 @@ IO_Serial_Bitrate(int bitrate)
 }
 
 static bool
-IO_Serial_WaitToRead (int hnd, unsigned delay_ms, unsigned timeout_ms)
+IO_Serial_WaitToRead (int hnd, int cancel, unsigned delay_ms, unsigned timeout_ms)
 {
   int rval;
 #ifdef HAVE_POLL
-  struct pollfd ufds;
+  struct pollfd ufds[2];
 #else
   fd_set rfds;
   struct timeval tv;
 #endif
 
   if (delay_ms > 0)
-    {
-#ifdef HAVE_NANOSLEEP
-      struct timespec req_ts;
-
-      req_ts.tv_sec = delay_ms / 1000;
-      req_ts.tv_nsec = (delay_ms % 1000) * 1000000L;
-      nanosleep (&req_ts, NULL);
-#else
-      usleep ((unsigned long) (delay_ms * 1000L));
-#endif
-    }
+    IO_Serial_Sleep (delay_ms);
 
 #ifdef HAVE_POLL
-  ufds.fd = hnd;
-  ufds.events = POLLIN;
-  ufds.revents = 0x0000;
+  ufds[0].fd = hnd;
+  ufds[0].events = POLLIN;
+  ufds[0].revents = 0x0000;
 
-  rval = poll (&ufds, 1, timeout_ms);
-  if (rval != 1)
+  /* A byte in the cancel pipe ends the wait, poll ignores it if negative */
+  ufds[1].fd = cancel;
+  ufds[1].events = POLLIN;
+  ufds[1].revents = 0x0000;
+
+  rval = poll (ufds, 2, timeout_ms);
+  if ((rval < 1) || (((ufds[1].revents) & POLLIN) == POLLIN))
     return (FALSE);
 
-  return (((ufds.revents) & POLLIN) == POLLIN);
+  /* A device gone is left to read(), which tells why */
+  return (((ufds[0].revents) & (POLLIN | POLLHUP | POLLERR)) != 0);
 #else
   tv.tv_sec = timeout_ms / 1000;
   tv.tv_usec = (timeout_ms % 1000) * 1000L;
@@ -771,60 +1368,121 @@ IO_Serial_WaitToRead (int hnd, unsigned delay_ms, unsigned timeout_ms)
   FD_ZERO (&rfds);
   FD_SET (hnd, &rfds);
 
-  rval = select (hnd + 1, &rfds, NULL, NULL, &tv);
+  if (cancel >= 0)
+    FD_SET (cancel, &rfds);
+
+  rval = select (MAX (hnd, cancel) + 1, &rfds, NULL, NULL, &tv);
+
+  if ((cancel >= 0) && FD_ISSET (cancel, &rfds))
+    return FALSE;
 
   return FD_ISSET (hnd, &rfds);
 #endif
 }
 
 static bool
-IO_Serial_WaitToWrite (int hnd, unsigned delay_ms, unsigned timeout_ms)
+IO_Serial_WaitToWrite (int hnd, int cancel, unsigned delay_ms, unsigned timeout_ms)
 {
   int rval;
 #ifdef HAVE_POLL
-  struct pollfd ufds;
+  struct pollfd ufds[2];
 #else
-  fd_set rfds;
+  fd_set rfds, cfds;
   struct timeval tv;
 #endif
 
   if (delay_ms > 0)
-    {
-#ifdef HAVE_NANOSLEEP
-      struct timespec req_ts;
-
-      req_ts.tv_sec = delay_ms / 1000;
-      req_ts.tv_nsec = (delay_ms % 1000) * 1000000L;
-      nanosleep (&req_ts, NULL);
-#else
-      usleep ((unsigned long) (delay_ms * 1000L));
-#endif
-    }
+    IO_Serial_Sleep (delay_ms);
 
 #ifdef HAVE_POLL
-  ufds.fd = hnd;
-  ufds.events = POLLOUT;
-  ufds.revents = 0x0000;
+  ufds[0].fd = hnd;
+  ufds[0].events = POLLOUT;
+  ufds[0].revents = 0x0000;
+
+  ufds[1].fd = cancel;
+  ufds[1].events = POLLIN;
+  ufds[1].revents = 0x0000;
 
-  rval = poll (&ufds, 1, timeout_ms);
-  if (rval != 1)
+  rval = poll (ufds, 2, timeout_ms);
+  if ((rval < 1) || (((ufds[1].revents) & POLLIN) == POLLIN))
     return (FALSE);
 
-  return (((ufds.revents) & POLLOUT) == POLLOUT);
+  return (((ufds[0].revents) & (POLLOUT | POLLHUP | POLLERR)) != 0);
 #else
   tv.tv_sec = timeout_ms / 1000;
   tv.tv_usec = (timeout_ms % 1000) * 1000L;
 
   FD_ZERO (&rfds);
   FD_SET (hnd, &rfds);
+  FD_ZERO (&cfds);
 
-  rval = select (hnd + 1, NULL, &rfds, NULL, &tv);
+  if (cancel >= 0)
+    FD_SET (cancel, &cfds);
+
+  rval = select (MAX (hnd, cancel) + 1, &cfds, &rfds, NULL, &tv);
+
+  if ((cancel >= 0) && FD_ISSET (cancel, &cfds))
+    return FALSE;
 
   return FD_ISSET (hnd, &rfds);
 
 #endif
 }
 
+static void
+IO_Serial_Sleep (unsigned delay_ms)
+{
+#ifdef HAVE_NANOSLEEP
+  struct timespec req_ts;
+
+  req_ts.tv_sec = delay_ms / 1000;
+  req_ts.tv_nsec = (delay_ms % 1000) * 1000000L;
+  nanosleep (&req_ts, NULL);
+#else
+  usleep ((unsigned long) (delay_ms * 1000L));
+#endif
+}
+
+static void
+IO_Serial_AddTime (struct timespec *ts, unsigned long delay_us)
+{
+  ts->tv_sec += delay_us / 1000000L;
+  ts->tv_nsec += (delay_us % 1000000L) * 1000L;
+
+  if (ts->tv_nsec >= 1000000000L)
+    {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void
+IO_Serial_SleepUntil (struct timespec *deadline)
+{
+#if defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME)
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+#else
+  struct timespec now;
+  long delay_us;
+
+  IO_Serial_GetTime (&now);
+
+  delay_us = (deadline->tv_sec - now.tv_sec) * 1000000L +
+    (deadline->tv_nsec - now.tv_nsec) / 1000L;
+
+  if (delay_us <= 0)
+    return;
+
+#ifdef HAVE_NANOSLEEP
+  now.tv_sec = delay_us / 1000000L;
+  now.tv_nsec = (delay_us % 1000000L) * 1000L;
+  nanosleep (&now, NULL);
+#else
+  usleep ((unsigned long) delay_us);
+#endif
+#endif
+}
+
 static void
 IO_Serial_Clear (IO_Serial * io)
 {
@@ -834,6 +1492,13 @@ IO_Serial_Clear (IO_Serial * io)
   memset (io->PnP_id, 0, IO_SERIAL_PNPID_SIZE);
   io->PnP_id_size = 0;
   io->usbserial = FALSE;
+  io->trace = NULL;
+  io->tracing = FALSE;
+  io->record = NULL;
+  io->replay = NULL;
+  memset (&(io->stats), 0, sizeof (IO_Serial_Stats));
+  io->cancel[0] = io->cancel[1] = -1;
+  io->cancelled = FALSE;
 }
 
 static void
@@ -883,6 +1548,13 @@ IO_Serial_ClearPropertiesCache (IO_Serial * io)
     }
 }
 
+static bool
+IO_Serial_IsGone (IO_Serial * io, int error)
+{
+  /* Only a USB-serial device goes away and comes back while open */
+  return io->usbserial && ((error == EIO) || (error == ENODEV));
+}
+
 static void
 IO_Serial_DeviceName (unsigned com, bool usbserial, char * filename, unsigned length)
 {
@@ -981,3 +1653,278 @@ IO_Serial_InitPnP (IO_Serial * io)
   io->PnP_id_size = i;
   return TRUE;
 }
+
+static unsigned long
+IO_Serial_TraceNext (IO_Serial_TraceBuffer * trace)
+{
+  /* Writers only need to agree on the slot, no lock is taken */
+#if defined(__GNUC__)
+  return __sync_fetch_and_add (&(trace->head), 1);
+#else
+  return (trace->head)++;
+#endif
+}
+
+static bool
+IO_Serial_InitRecord (IO_Serial * io, const char * name)
+{
+  char filename[IO_SERIAL_TRACE_FILENAME_LENGTH];
+  unsigned int header[2];
+
+  snprintf (filename, IO_SERIAL_TRACE_FILENAME_LENGTH, "%s.%u", name, io->com);
+
+  io->record = fopen (filename, "wb");
+
+  if (io->record == NULL)
+    return FALSE;
+
+  /* Same format as trace dumps, the count is written on close */
+  header[0] = IO_SERIAL_TRACE_UNTIL_EOF;
+  header[1] = (unsigned int) sizeof (IO_Serial_TraceEvent);
+
+  fwrite (IO_SERIAL_TRACE_MAGIC, 1, 4, io->record);
+  fwrite (header, sizeof (unsigned int), 2, io->record);
+
+  return TRUE;
+}
+
+static void
+IO_Serial_CloseRecord (IO_Serial * io)
+{
+  unsigned int count;
+
+  count = (unsigned int) ((ftell (io->record) - IO_SERIAL_TRACE_HEADER_SIZE) / sizeof (IO_Serial_TraceEvent));
+
+  if (fseek (io->record, 4, SEEK_SET) == 0)
+    fwrite (&count, sizeof (unsigned int), 1, io->record);
+
+  fclose (io->record);
+  io->record = NULL;
+}
+
+static bool
+IO_Serial_InitReplay (IO_Serial * io, const char * filename)
+{
+  IO_Serial_Replay *replay;
+  unsigned int header[2];
+  char magic[4];
+  long size;
+  FILE *file;
+
+  file = fopen (filename, "rb");
+
+  if (file == NULL)
+    return FALSE;
+
+  if ((fread (magic, 1, 4, file) != 4) || 
+      (memcmp (magic, IO_SERIAL_TRACE_MAGIC, 4) != 0) ||
+      (fread (header, sizeof (unsigned int), 2, file) != 2) ||
+      (header[1] != sizeof (IO_Serial_TraceEvent)) ||
+      (fseek (file, 0, SEEK_END) != 0) ||
+      ((size = ftell (file)) < IO_SERIAL_TRACE_HEADER_SIZE) ||
+      (fseek (file, IO_SERIAL_TRACE_HEADER_SIZE, SEEK_SET) != 0))
+    {
+      fclose (file);
+      return FALSE;
+    }
+
+  replay = (IO_Serial_Replay *) calloc (1, sizeof (IO_Serial_Replay));
+
+  if (replay == NULL)
+    {
+      fclose (file);
+      return FALSE;
+    }
+
+  replay->num_events = (size - IO_SERIAL_TRACE_HEADER_SIZE) / sizeof (IO_Serial_TraceEvent);
+  replay->num_events = MIN (replay->num_events, header[0]);
+  replay->events = (IO_Serial_TraceEvent *) malloc (MAX (replay->num_events, 1) * sizeof (IO_Serial_TraceEvent));
+
+  if ((replay->events == NULL) ||
+      (fread (replay->events, sizeof (IO_Serial_TraceEvent), replay->num_events, file) != replay->num_events))
+    {
+      if (replay->events != NULL)
+	free (replay->events);
+
+      free (replay);
+      fclose (file);
+      return FALSE;
+    }
+
+  fclose (file);
+
+  replay->realtime = (getenv (IO_SERIAL_REPLAY_REALTIME_ENV) != NULL);
+  IO_Serial_GetTime (&(replay->start));
+
+  io->replay = replay;
+
+  return TRUE;
+}
+
+static void
+IO_Serial_CloseReplay (IO_Serial * io)
+{
+  IO_Serial_Replay *replay = io->replay;
+  struct timespec now;
+
+  IO_Serial_GetTime (&now);
+
+  /* Result of the replay, the purpose of running one */
+  fprintf (stderr, "IO: Replay %s: %lu of %lu events, %lu bytes out, %lu bytes in, %.6f s\n",
+	   replay->failed ? "FAILED" : "OK", replay->next, replay->num_events,
+	   replay->bytes_out, replay->bytes_in,
+	   (now.tv_sec - replay->start.tv_sec) + (now.tv_nsec - replay->start.tv_nsec) / 1000000000.0);
+
+  free (replay->events);
+  free (replay);
+
+  io->replay = NULL;
+  memset (&(io->stats), 0, sizeof (IO_Serial_Stats));
+}
+
+static IO_Serial_TraceEvent *
+IO_Serial_ReplayEvent (IO_Serial_Replay * replay)
+{
+  IO_Serial_TraceEvent *event;
+  BYTE type;
+
+  /* Skip consumed data and events of the layers above */
+  while (replay->next < replay->num_events)
+    {
+      event = replay->events + replay->next;
+      type = event->type & ~IO_SERIAL_TRACE_MORE;
+
+      if (((type == IO_SERIAL_TRACE_OUT) || (type == IO_SERIAL_TRACE_IN)) &&
+	  (replay->offset < event->length))
+	return event;
+
+      if ((type == IO_SERIAL_TRACE_TIMEOUT) || (type == IO_SERIAL_TRACE_ERROR) ||
+	  (type == IO_SERIAL_TRACE_CANCEL))
+	return event;
+
+      replay->next++;
+      replay->offset = 0;
+    }
+
+  return NULL;
+}
+
+static bool
+IO_Serial_ReplayRead (IO_Serial * io, unsigned size, BYTE * data)
+{
+  IO_Serial_Replay *replay = io->replay;
+  IO_Serial_TraceEvent *event;
+  struct timespec deadline;
+  unsigned count;
+  long delay;
+  BYTE type;
+
+  if (replay->failed)
+    return FALSE;
+
+  for (count = 0; count < size; count++)
+    {
+      event = IO_Serial_ReplayEvent (replay);
+
+      /* The driver reads where the record ends or writes */
+      if ((event == NULL) || 
+	  ((type = (event->type & ~IO_SERIAL_TRACE_MORE)) == IO_SERIAL_TRACE_OUT))
+	{
+	  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_IN, count, data);
+	  return IO_Serial_ReplayFail (io);
+	}
+
+      /* Reader latency since the last write, as recorded */
+      if (replay->realtime && (replay->offset == 0) && (replay->sent_event != NULL))
+	{
+	  delay = (long) (event->sec - replay->sent_event->sec) * 1000000L +
+	    ((long) event->nsec - (long) replay->sent_event->nsec) / 1000L;
+
+	  if (delay > 0)
+	    {
+	      deadline = replay->sent;
+	      IO_Serial_AddTime (&deadline, (unsigned long) delay);
+	      IO_Serial_SleepUntil (&deadline);
+	    }
+	}
+
+      if ((type == IO_SERIAL_TRACE_TIMEOUT) || (type == IO_SERIAL_TRACE_ERROR) ||
+	  (type == IO_SERIAL_TRACE_CANCEL))
+	{
+	  replay->next++;
+	  replay->offset = 0;
+
+	  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_IN, count, data);
+	  IO_SERIAL_TRACE (io, type, 0, NULL);
+	  return FALSE;
+	}
+
+      data[count] = event->data[replay->offset++];
+    }
+
+  replay->bytes_in += size;
+  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_IN, size, data);
+
+  return TRUE;
+}
+
+static bool
+IO_Serial_ReplayWrite (IO_Serial * io, unsigned size, BYTE * data)
+{
+  IO_Serial_Replay *replay = io->replay;
+  IO_Serial_TraceEvent *event = NULL;
+  unsigned count;
+  BYTE type;
+
+  if (replay->failed)
+    return FALSE;
+
+  for (count = 0; count < size; count++)
+    {
+      event = IO_Serial_ReplayEvent (replay);
+
+      if (event == NULL)
+	return IO_Serial_ReplayFail (io);
+
+      type = event->type & ~IO_SERIAL_TRACE_MORE;
+
+      /* The write failed when it was recorded */
+      if ((type == IO_SERIAL_TRACE_TIMEOUT) || (type == IO_SERIAL_TRACE_ERROR) ||
+	  (type == IO_SERIAL_TRACE_CANCEL))
+	{
+	  replay->next++;
+	  replay->offset = 0;
+
+	  IO_SERIAL_TRACE (io, type, 0, NULL);
+	  return FALSE;
+	}
+
+      /* Outgoing bytes must match the record, however they are split */
+      if ((type != IO_SERIAL_TRACE_OUT) || (event->data[replay->offset] != data[count]))
+	return IO_Serial_ReplayFail (io);
+
+      replay->offset++;
+    }
+
+  replay->bytes_out += size;
+
+  if (event != NULL)
+    {
+      replay->sent_event = event;
+      IO_Serial_GetTime (&(replay->sent));
+    }
+
+  IO_SERIAL_TRACE (io, IO_SERIAL_TRACE_OUT, size, data);
+
+  return TRUE;
+}
+
+static bool
+IO_Serial_ReplayFail (IO_Serial * io)
+{
+  io->replay->failed = TRUE;
+
+  fprintf (stderr, "IO: Replay differs from the record at event %lu\n", io->replay->next);
+
+  return FALSE;
+}
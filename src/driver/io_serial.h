@@ -24,6 +24,8 @@
 #define _IO_SERIAL_
 
 #include "defines.h"
+#include <stdio.h>
+#include <time.h>
 
 /* 
  * Exported constants definition
@@ -41,6 +43,37 @@
 /* Maximum size of PnP Com ID */
 #define IO_SERIAL_PNPID_SIZE 		256
 
+/* Trace event types */
+#define IO_SERIAL_TRACE_OUT		0x01	/* Bytes written to the reader */
+#define IO_SERIAL_TRACE_IN		0x02	/* Bytes read from the reader */
+#define IO_SERIAL_TRACE_TIMEOUT		0x03	/* Timeout reading or writing */
+#define IO_SERIAL_TRACE_ERROR		0x04	/* Error reading or writing */
+#define IO_SERIAL_TRACE_COMMAND		0x05	/* Reader command before framing */
+#define IO_SERIAL_TRACE_BLOCK_OUT	0x06	/* Protocol block sent to the ICC */
+#define IO_SERIAL_TRACE_BLOCK_IN	0x07	/* Protocol block received from the ICC */
+#define IO_SERIAL_TRACE_CANCEL		0x08	/* Wait reading or writing cancelled */
+#define IO_SERIAL_TRACE_MORE		0x80	/* Data continues in the next event */
+
+/* Events kept in the trace of a serial device, must be a power of two */
+#ifndef IO_SERIAL_TRACE_EVENTS
+#define IO_SERIAL_TRACE_EVENTS		4096
+#endif
+
+/* Data bytes in each trace event */
+#define IO_SERIAL_TRACE_DATA		22
+
+/* Buckets of a latency histogram, bucket i counts latencies below 2^i us */
+#define IO_SERIAL_STATS_BUCKETS		24
+
+/*
+ * Exported macros definition
+ */
+
+/* Record a trace event, only a test when not tracing nor recording */
+#define IO_SERIAL_TRACE(io, type, size, data) \
+	do { if ((io)->tracing || (io)->record != NULL) \
+	  IO_Serial_Trace ((io), (type), (size), (data)); } while (0)
+
 /*
  * Exported datatypes definition
  */
@@ -58,6 +91,89 @@ typedef struct
 }
 IO_Serial_Properties;
 
+/* Trace event, 32 bytes */
+typedef struct
+{
+  unsigned int sec;			/* Monotonic timestamp, seconds */
+  unsigned int nsec;			/* Monotonic timestamp, nanoseconds */
+  BYTE type;				/* Event type and continuation flag */
+  BYTE length;				/* Bytes used in data */
+  BYTE data[IO_SERIAL_TRACE_DATA];
+}
+IO_Serial_TraceEvent;
+
+/* Ring buffer of trace events */
+typedef struct
+{
+  IO_Serial_TraceEvent events[IO_SERIAL_TRACE_EVENTS];
+  unsigned long head;			/* Number of events recorded */
+}
+IO_Serial_TraceBuffer;
+
+/* Recorded session fed back instead of the serial device */
+typedef struct
+{
+  IO_Serial_TraceEvent * events;	/* Recorded events */
+  unsigned long num_events;		/* Number of recorded events */
+  unsigned long next;			/* Next event to replay */
+  unsigned offset;			/* Bytes of next event already replayed */
+  bool realtime;			/* Reproduce the recorded reader latency */
+  bool failed;				/* Driver traffic differed from the record */
+  unsigned long bytes_out;		/* Bytes validated against the record */
+  unsigned long bytes_in;		/* Bytes fed back from the record */
+  struct timespec start;		/* Time the replay started */
+  struct timespec sent;			/* Time the last recorded write was replayed */
+  IO_Serial_TraceEvent * sent_event;	/* Last recorded write replayed */
+}
+IO_Serial_Replay;
+
+/* Latency histogram, in microseconds */
+typedef struct
+{
+  unsigned long count;			/* Latencies recorded */
+  unsigned long total;			/* Sum of latencies */
+  unsigned long max;			/* Largest latency */
+  unsigned long buckets[IO_SERIAL_STATS_BUCKETS]; /* Last bucket also counts longer ones */
+}
+IO_Serial_Histogram;
+
+/* Counters of every layer using the serial device, updated with exclusive access to it */
+typedef struct
+{
+  /* Serial device */
+  unsigned long io_reads;		/* read() calls */
+  unsigned long io_writes;		/* write() calls */
+  unsigned long io_bytes_in;		/* Bytes read */
+  unsigned long io_bytes_out;		/* Bytes written */
+  unsigned long io_timeouts;		/* Reads and writes timed out */
+  unsigned long io_errors;		/* Reads and writes failed */
+  unsigned long io_reopens;		/* Times the device was opened again */
+  IO_Serial_Histogram io_read;		/* Time taken by IO_Serial_Read */
+
+  /* Reader */
+  unsigned long ifd_commands;		/* Commands sent to the reader */
+  unsigned long ifd_baudrates;		/* Baudrate changes sent to the reader */
+  unsigned long ifd_parities;		/* Parity changes sent to the reader */
+
+  /* ICC */
+  unsigned long icc_resets;		/* Asynchronous ICC resets */
+  unsigned long icc_transmits;		/* Transmissions to the ICC */
+  unsigned long icc_receives;		/* Receptions from the ICC */
+  unsigned long icc_skipped;		/* Memory card bytes not rewritten as unchanged */
+  IO_Serial_Histogram icc_receive;	/* Time taken by receptions from the ICC */
+
+  /* Protocols */
+  unsigned long t0_tpdus;		/* T=0 TPDUs exchanged */
+  unsigned long t0_nulls;		/* T=0 NULL procedure bytes received */
+  unsigned long t0_get_responses;	/* T=0 GET RESPONSE TPDUs issued */
+  unsigned long t1_blocks_out;		/* T=1 blocks sent */
+  unsigned long t1_blocks_in;		/* T=1 blocks received */
+  unsigned long t1_wtx;			/* T=1 waiting time extensions */
+  unsigned long t1_errors;		/* T=1 exchanges aborted */
+  IO_Serial_Histogram protocol_command;	/* Time taken by ICC commands */
+}
+IO_Serial_Stats;
+
 /* IO_Serial exported datatype */
 typedef struct
 {
@@ -67,6 +183,13 @@ typedef struct
   BYTE PnP_id[IO_SERIAL_PNPID_SIZE];	/* PnP Id of the serial device */
   unsigned PnP_id_size;			/* Length of PnP Id */
   bool usbserial;			/* Is serial USB device */
+  IO_Serial_TraceBuffer * trace;	/* Trace ring buffer, NULL if never enabled */
+  bool tracing;				/* Events are being recorded */
+  FILE * record;			/* Session being recorded, NULL if not */
+  IO_Serial_Replay * replay;		/* Session being replayed, NULL if not */
+  IO_Serial_Stats stats;		/* Counters since the device was opened */
+  int cancel[2];			/* Pipe waking waits on the device, -1 if none */
+  volatile bool cancelled;		/* Waits fail at once until reset */
 }
 IO_Serial;
 
@@ -89,6 +212,32 @@ extern bool IO_Serial_GetProperties (IO_Serial * io, IO_Serial_Properties * prop
 /* Input and output */
 extern bool IO_Serial_Read (IO_Serial * io, unsigned timeout, unsigned size, BYTE * data);
 extern bool IO_Serial_Write (IO_Serial * io, unsigned delay, unsigned size, BYTE * data);
+extern bool IO_Serial_WritePaced (IO_Serial * io, unsigned long first_delay, unsigned long char_delay, unsigned size, BYTE * data);
+
+/* Time (us) taken to send one character with the current properties */
+extern unsigned long IO_Serial_GetCharTime (IO_Serial * io);
+
+/* Wait for a change in the card detect modem lines */
+extern bool IO_Serial_WaitLines (IO_Serial * io, unsigned timeout);
+
+/* Open the device again after it went away, with the same properties */
+extern bool IO_Serial_Reopen (IO_Serial * io);
+
+/* Abort waits on the device from another thread, until reset */
+extern void IO_Serial_Cancel (IO_Serial * io);
+extern bool IO_Serial_IsCancelled (IO_Serial * io);
+extern void IO_Serial_ResetCancel (IO_Serial * io);
+
+/* Tracing of events */
+extern bool IO_Serial_SetTrace (IO_Serial * io, bool enable);
+extern void IO_Serial_Trace (IO_Serial * io, BYTE type, unsigned size, BYTE * data);
+extern bool IO_Serial_DumpTrace (IO_Serial * io, const char * filename);
+extern bool IO_Serial_PrintTrace (const char * filename, FILE * output);
+
+/* Latency statistics */
+extern void IO_Serial_GetTime (struct timespec *ts);
+extern void IO_Serial_AddLatency (IO_Serial_Histogram * hist, struct timespec *start);
+extern IO_Serial_Stats *IO_Serial_GetStats (IO_Serial * io);
 
 /* Serial port atributes */
 extern unsigned IO_Serial_GetCom (IO_Serial * io);
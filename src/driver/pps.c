@@ -87,7 +87,7 @@ PPS_New (ICC_Async * icc)
 int
 PPS_Perform (PPS * pps, BYTE * params, unsigned *length)
 {
-  ATR *atr;
+  ICC_Async_Profile *profile;
   int ret;
 
   /* Perform PPS Exchange if requested */
@@ -121,11 +121,11 @@ PPS_Perform (PPS * pps, BYTE * params, unsigned *length)
       PPS_SelectFirstProtocol (pps);
 
 #ifndef PPS_USE_DEFAULT_TIMINGS
-      atr = ICC_Async_GetAtr (pps->icc);
+      profile = ICC_Async_GetProfile (pps->icc);
 
-      ATR_GetParameter (atr, ATR_PARAMETER_N, &(pps->parameters.n));
-      ATR_GetParameter (atr, ATR_PARAMETER_D, &(pps->parameters.d));
-      ATR_GetParameter (atr, ATR_PARAMETER_F, &(pps->parameters.f));
+      pps->parameters.n = profile->n;
+      pps->parameters.d = (double) profile->d / ICC_ASYNC_D_SCALE;
+      pps->parameters.f = profile->f;
 #endif
 
     }
@@ -255,13 +255,9 @@ static int
 PPS_InitICC (PPS * pps)
 {
   unsigned long baudrate;
-  long double work_etu;
 
-  /* Work etu = (1/D) * (F/fs) * 1000 milliseconds */
-  work_etu = (1000 * pps->parameters.f) / (pps->parameters.d * ICC_Async_GetClockRate (pps->icc));
-
-  /* Baudrate = 1000 / etu bps */
-  baudrate = (long unsigned int) (1000 / work_etu);
+  /* Baudrate = D * fs / F bps */
+  baudrate = (unsigned long) ((pps->parameters.d * ICC_Async_GetClockRate (pps->icc)) / pps->parameters.f);
 
 #ifdef DEBUG_PROTOCOL
   printf ("PPS: Baudrate = %d\n", baudrate);
@@ -326,19 +322,11 @@ PPS_InitProtocol (PPS * pps)
 static void
 PPS_SelectFirstProtocol (PPS * pps)
 {
-  ATR *atr = ICC_Async_GetAtr (pps->icc);
-  unsigned np;
-
-  pps->parameters.t = ATR_PROTOCOL_TYPE_T0;
-
-  ATR_GetNumberOfProtocols (atr, &np);
-
   /* 
    * Get protocol offered by interface bytes T*2 if available, 
    * (that is, if TD1 is available), * otherwise use default T=0
    */
-  if (np>1)
-    ATR_GetProtocolType (atr, 2, &(pps->parameters.t));
+  pps->parameters.t = (ICC_Async_GetProfile (pps->icc))->t;
 
 #ifdef DEBUG_PROTOCOL
   printf ("PPS: Protocol T=%d selected\n", pps->parameters.t);
@@ -492,7 +492,7 @@ Protocol_Sync_ReadBinary (Protocol_Sync * ps, APDU_Cmd * cmd, APDU_Rsp ** rsp)
 static int
 Protocol_Sync_UpdateBinary (Protocol_Sync * ps, APDU_Cmd * cmd, APDU_Rsp ** rsp)
 {
-  unsigned available, offset;
+  unsigned available, offset, skipped;
   unsigned long provided;
   BYTE buffer[2];
   int ret;
@@ -501,8 +501,12 @@ Protocol_Sync_UpdateBinary (Protocol_Sync * ps, APDU_Cmd * cmd, APDU_Rsp ** rsp)
   available = MAX ((signed) (ps->length) - (signed) (offset), 0);
   provided = APDU_Cmd_Lc (cmd);
 
-  /* Write data */
-  ret = ICC_Sync_Write (ps->icc, ps->path + offset, MIN (available, provided), APDU_Cmd_Data (cmd));
+  /* Write only the data that differs from the card contents */
+  ret = ICC_Sync_Update (ps->icc, ps->path + offset, MIN (available, provided), APDU_Cmd_Data (cmd), &skipped);
+
+#ifdef DEBUG_PROTOCOL
+  printf ("Protocol: Update binary skipped %d unchanged bytes\n", skipped);
+#endif
 
   /* Read only error */
   if (ret == ICC_SYNC_RO_ERROR)
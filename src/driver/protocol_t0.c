@@ -88,21 +88,19 @@ Protocol_T0_Init (Protocol_T0 * t0, ICC_Async * icc, PPS_ProtocolParameters * pa
 {
   ICC_Async_Timings timings;
   BYTE wi;
-#ifndef PROTOCOL_T0_USE_DEFAULT_TIMINGS
-  ATR *atr = ICC_Async_GetAtr (icc);
-#endif
 
   /* Set ICC */
   t0->icc = icc;
 
   /* Integer value WI  = TC2, by default 10 */
 #ifndef PROTOCOL_T0_USE_DEFAULT_TIMINGS
-  if (ATR_GetInterfaceByte (atr, 2, ATR_INTERFACE_BYTE_TC, &(wi)) != ATR_OK)
+  wi = (ICC_Async_GetProfile (icc))->wi;
+#else
+  wi = PROTOCOL_T0_DEFAULT_WI;
 #endif
-    wi = PROTOCOL_T0_DEFAULT_WI;
 
-  /* WWT = 960 * WI * (Fi / f) * 1000 milliseconds */
-  t0->wwt = (long unsigned int) (960 * wi * (params->f / ICC_Async_GetClockRate (t0->icc)) * 1000);
+  /* WWT = 960 * WI * Fi clock cycles, in microseconds */
+  t0->wwt = ICC_Async_GetClockTime (t0->icc, 960 * wi * (unsigned long) params->f);
   
   /* Set timings */
   ICC_Async_GetTimings (t0->icc, &timings);
@@ -113,7 +111,7 @@ Protocol_T0_Init (Protocol_T0 * t0, ICC_Async * icc, PPS_ProtocolParameters * pa
   ICC_Async_SetTimings (t0->icc, &timings);
 
 #ifdef DEBUG_PROTOCOL
-  printf ("Protocol: T=0: WWT=%d\n", t0->wwt);
+  printf ("Protocol: T=0: WWT=%lu\n", t0->wwt);
 #endif
   
   return PROTOCOL_T0_OK;
@@ -736,6 +734,7 @@ Protocol_T0_ExchangeTPDU (Protocol_T0 * t0, APDU_Cmd * cmd, APDU_Rsp ** rsp)
   BYTE *data;
   long Lc, Le, sent, recv;
   int ret = PROTOCOL_T0_OK, nulls, cmd_case;
+  IO_Serial_Stats *stats;
 
   /* Parse APDU */
   Lc = APDU_Cmd_Lc (cmd);
@@ -747,6 +746,12 @@ Protocol_T0_ExchangeTPDU (Protocol_T0 * t0, APDU_Cmd * cmd, APDU_Rsp ** rsp)
   if ((cmd_case != APDU_CASE_2S) && (cmd_case != APDU_CASE_3S))
     return PROTOCOL_T0_ERROR;
 
+  stats = ICC_Async_GetStats (t0->icc);
+  stats->t0_tpdus++;
+
+  if (APDU_Cmd_Ins (cmd) == 0xC0)
+    stats->t0_get_responses++;
+
   /* Initialise transmission */
   if (ICC_Async_BeginTransmission (t0->icc) != ICC_ASYNC_OK)
     {
@@ -757,8 +762,6 @@ Protocol_T0_ExchangeTPDU (Protocol_T0 * t0, APDU_Cmd * cmd, APDU_Rsp ** rsp)
   /* Send header bytes */
   if (ICC_Async_Transmit (t0->icc, 5, APDU_Cmd_Header (cmd)) != ICC_ASYNC_OK)
     {
-      ICC_Async_EndTransmission (t0->icc);
-
       (*rsp) = NULL;
       return PROTOCOL_T0_ICC_ERROR;
     }
@@ -787,6 +790,7 @@ Protocol_T0_ExchangeTPDU (Protocol_T0 * t0, APDU_Cmd * cmd, APDU_Rsp ** rsp)
       if (buffer[recv] == 0x60)
         {
           nulls++;
+          stats->t0_nulls++;
 
           /* Maximum number of nulls reached */
           if (nulls >= PROTOCOL_T0_MAX_NULLS)
@@ -938,10 +942,6 @@ Protocol_T0_ExchangeTPDU (Protocol_T0 * t0, APDU_Cmd * cmd, APDU_Rsp ** rsp)
   else
     (*rsp) = NULL;
 
-  /* End of transmission */
-  if (ICC_Async_EndTransmission (t0->icc) != ICC_ASYNC_OK)
-    return PROTOCOL_T0_ICC_ERROR;
-
   return (ret);
 }
 
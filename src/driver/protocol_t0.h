@@ -47,7 +47,7 @@
 typedef struct
 {
   ICC_Async *icc;		/* Asynchrosous integrated cirtuit card */
-  unsigned long wwt;		/* Work waiting time (ms) */
+  unsigned long wwt;		/* Work waiting time (us) */
 }
 Protocol_T0;
 
@@ -30,13 +30,12 @@
 /*
  * Not exported constants definition
  */
-#define PROTOCOL_T1_DEFAULT_IFSC        32
 #define PROTOCOL_T1_DEFAULT_IFSD        32
 #define PROTOCOL_T1_MAX_IFSC            251  /* Cannot send > 255 buffer */
 #define PROTOCOL_T1_DEFAULT_CWI         13
 #define PROTOCOL_T1_DEFAULT_BWI         4
-#define PROTOCOL_T1_EDC_LRC             0
-#define PROTOCOL_T1_EDC_CRC             1
+#define PROTOCOL_T1_EDC_LRC             ICC_ASYNC_EDC_LRC
+#define PROTOCOL_T1_EDC_CRC             ICC_ASYNC_EDC_CRC
 
 /*
  * Not exported functions declaration
@@ -52,7 +51,7 @@ static int
 Protocol_T1_ReceiveBlock (Protocol_T1 * t1, T1_Block ** block);
 
 static int
-Protocol_T1_UpdateBWT (Protocol_T1 * t1, unsigned short bwt);
+Protocol_T1_UpdateBWT (Protocol_T1 * t1, unsigned long bwt);
 
 /*
  * Exproted funtions definition
@@ -75,25 +74,17 @@ int
 Protocol_T1_Init (Protocol_T1 * t1, ICC_Async * icc, PPS_ProtocolParameters * params)
 {
   ICC_Async_Timings timings;
-  BYTE ta, tb, tc, cwi, bwi;
-  unsigned long baudrate;
-  double work_etu;
-  ATR *atr;
-  int i;
+  ICC_Async_Profile *profile;
+  BYTE cwi, bwi;
 
   /* Set ICC */
   t1->icc = icc;
 
-  /* Get ATR of the card */
-  atr = ICC_Async_GetAtr (t1->icc);
+  /* Get parameters of the card */
+  profile = ICC_Async_GetProfile (t1->icc);
 
   /* Set IFSC */
-  if (ATR_GetInterfaceByte (atr, 3, ATR_INTERFACE_BYTE_TA, &ta) == ATR_NOT_FOUND)
-    t1->ifsc = PROTOCOL_T1_DEFAULT_IFSC;
-  else if ((ta != 0x00) && (ta != 0xFF))
-    t1->ifsc = ta;
-  else
-    t1->ifsc = PROTOCOL_T1_DEFAULT_IFSC;
+  t1->ifsc = profile->ifsc;
 
   /* Towitoko does not allow IFSC > 251 */
   t1->ifsc = MIN (t1->ifsc, PROTOCOL_T1_MAX_IFSC);
@@ -101,49 +92,26 @@ Protocol_T1_Init (Protocol_T1 * t1, ICC_Async * icc, PPS_ProtocolParameters * pa
   /* Set IFSD */
   t1->ifsd = PROTOCOL_T1_DEFAULT_IFSD;
 
+  /* Get CWI and BWI */
 #ifndef PROTOCOL_T1_USE_DEFAULT_TIMINGS
-  /* Calculate CWI and BWI */
-  if (ATR_GetInterfaceByte (atr, 3, ATR_INTERFACE_BYTE_TB, &tb) == ATR_NOT_FOUND)
-    {
-#endif
-      cwi  = PROTOCOL_T1_DEFAULT_CWI;
-      bwi = PROTOCOL_T1_DEFAULT_BWI;
-#ifndef PROTOCOL_T1_USE_DEFAULT_TIMINGS
-    }
-  else
-    {
-      cwi  = tb & 0x0F;
-      bwi = (tb & 0xF0) >> 4;
-    }
+  cwi = profile->cwi;
+  bwi = profile->bwi;
+#else
+  cwi = PROTOCOL_T1_DEFAULT_CWI;
+  bwi = PROTOCOL_T1_DEFAULT_BWI;
 #endif
   
-  /* Work etu  = (1000 / baudrate) milliseconds */
-  ICC_Async_GetBaudrate (t1->icc, &baudrate);
-  work_etu = 1000 / (double)baudrate;
-
   /* Set CWT = (2^CWI + 11) work etu */
-  t1->cwt = 1;
-
-  for (i = 0; i < cwi ; i++)
-    t1->cwt *= 2;
-
-  t1->cwt = (unsigned short) ((t1->cwt + 11) * work_etu);
+  t1->cwt = ICC_Async_GetEtuTime (t1->icc, (1UL << cwi) + 11);
 
   /* Set BWT = (2^BWI * 960 + 11) work etu */
-  t1->bwt = 1;
-  for (i = 0; i < bwi; i++)
-    t1->bwt *= 2;
+  t1->bwt = ICC_Async_GetEtuTime (t1->icc, (1UL << bwi) * 960 + 11);
 
-  t1->bwt = (unsigned short) ((t1->bwt * 960 + 11) * work_etu);
-
-  /* Set BGT = 22 * work etu */
-  t1->bgt = (unsigned short) (22 * work_etu);
+  /* Set BGT = 22 work etu */
+  t1->bgt = ICC_Async_GetEtuTime (t1->icc, 22);
 
   /* Set the error detection code type */
-  if (ATR_GetInterfaceByte (atr, 3, ATR_INTERFACE_BYTE_TC, &tc) == ATR_NOT_FOUND)
-    t1->edc = PROTOCOL_T1_EDC_LRC;
-  else
-    t1->edc = tc & 0x01;
+  t1->edc = profile->edc;
 
   /* Set initial send sequence (NS) */
   t1->ns = 1;
@@ -158,7 +126,7 @@ Protocol_T1_Init (Protocol_T1 * t1, ICC_Async * icc, PPS_ProtocolParameters * pa
   ICC_Async_SetTimings (t1->icc, &timings);
 
 #ifdef DEBUG_PROTOCOL
-  printf ("Protocol: T=1: IFSC=%d, IFSD=%d, CWT=%d, BWT=%d, BGT=%d, EDC=%s\n",
+  printf ("Protocol: T=1: IFSC=%d, IFSD=%d, CWT=%lu, BWT=%lu, BGT=%lu, EDC=%s\n",
           t1->ifsc, t1->ifsd, t1->cwt, t1->bwt, t1->bgt,
           (t1->edc == PROTOCOL_T1_EDC_LRC) ? "LRC" : "CRC");
 #endif
@@ -320,6 +288,7 @@ Protocol_T1_Command (Protocol_T1 * t1, APDU_Cmd * cmd, APDU_Rsp ** rsp)
             {
               /* Get wtx multiplier */
               wtx = (*T1_Block_GetInf (block));
+              ICC_Async_GetStats (t1->icc)->t1_wtx++;
 #ifdef DEBUG_PROTOCOL
               printf ("Protocol: Received block S(WTX request, %d)\n", wtx);
 #endif                                  
@@ -347,6 +316,8 @@ Protocol_T1_Command (Protocol_T1 * t1, APDU_Cmd * cmd, APDU_Rsp ** rsp)
 
   if (ret == PROTOCOL_T1_OK)
     (*rsp) = APDU_Rsp_New (buffer, counter);
+  else
+    ICC_Async_GetStats (t1->icc)->t1_errors++;
 
   if (buffer != NULL)
     free (buffer);
@@ -388,11 +359,11 @@ Protocol_T1_SendBlock (Protocol_T1 * t1, T1_Block * block)
       buffer = T1_Block_Raw (block);
       length = T1_Block_RawLen (block);
 
+      ICC_Async_Trace (t1->icc, IO_SERIAL_TRACE_BLOCK_OUT, length, buffer);
+      ICC_Async_GetStats (t1->icc)->t1_blocks_out++;
+
       if (ICC_Async_Transmit (t1->icc, length, buffer) != ICC_ASYNC_OK)
-        {
-          ICC_Async_EndTransmission (t1->icc);
-          ret = PROTOCOL_T1_ICC_ERROR;
-        }
+        ret = PROTOCOL_T1_ICC_ERROR;
 
       else
         ret = PROTOCOL_T1_OK;
@@ -445,11 +416,13 @@ Protocol_T1_ReceiveBlock (Protocol_T1 * t1, T1_Block ** block)
         }
     }
 
-  if (ICC_Async_Switch (t1->icc) != ICC_ASYNC_OK)
-    ret = PROTOCOL_T1_ICC_ERROR;
+  if ((ret == PROTOCOL_T1_OK) && ((*block) != NULL))
+    {
+      ICC_Async_Trace (t1->icc, IO_SERIAL_TRACE_BLOCK_IN, T1_Block_RawLen (*block), T1_Block_Raw (*block));
+      ICC_Async_GetStats (t1->icc)->t1_blocks_in++;
+    }
 
-  /* End of transmission */
-  if (ICC_Async_EndTransmission (t1->icc) != ICC_ASYNC_OK)
+  if (ICC_Async_Switch (t1->icc) != ICC_ASYNC_OK)
     ret = PROTOCOL_T1_ICC_ERROR;
 
   return ret;
@@ -469,7 +442,7 @@ Protocol_T1_Clear (Protocol_T1 * t1)
 }
 
 static int
-Protocol_T1_UpdateBWT (Protocol_T1 * t1, unsigned short bwt)
+Protocol_T1_UpdateBWT (Protocol_T1 * t1, unsigned long bwt)
 {
   ICC_Async_Timings timings;
   
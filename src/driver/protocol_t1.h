@@ -48,9 +48,9 @@ typedef struct
   ICC_Async *icc;       /* Asynchronous integrated cirtuit card */
   unsigned short ifsc;  /* Information field size for the ICC */
   unsigned short ifsd;  /* Information field size for the IFD */
-  unsigned short bgt;   /* Block guard time */
-  unsigned short bwt;   /* Block waiting time */
-  unsigned short cwt;   /* Character waiting time */
+  unsigned long bgt;    /* Block guard time (us) */
+  unsigned long bwt;    /* Block waiting time (us) */
+  unsigned long cwt;    /* Character waiting time (us) */
   int edc;              /* Type of error detection code */
   BYTE ns;              /* Send sequence number */
 }
@@ -3,7 +3,8 @@
 
     Mapping if CT-API / CT-BCS interface to the IFD Hanlder 2.0.
     Getting/Setting IFD/Protocol/ICC parameters other than the ATR is not
-    supported. IFDH_MAX_READERS simultaneous readers are supported.
+    supported. Readers are registered on demand, keyed by the reader number
+    in the high word of Lun, so any number of readers can be handled.
 
     This file is part of the Unix driver for Towitoko smartcard readers
     Copyright (C) 1998 1999 2000 2001 Carlos Prados <cprados@yahoo.com>
@@ -35,6 +36,8 @@
 #include <stdlib.h>
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
+#include <sys/time.h>
+#include <errno.h>
 #endif
 #ifdef DEBUG_IFDH
 #include <syslog.h>
@@ -44,11 +47,34 @@
  * Not exported constants definition
  */
 
-/* Maximum number of readers handled */
-#define IFDH_MAX_READERS        4
+/* Maximum number of slots per reader handled: Chipdrive Twin has two */
+#define IFDH_MAX_SLOTS          2
 
-/* Maximum number of slots per reader handled */
-#define IFDH_MAX_SLOTS          1
+/* Simultaneous readers reported to the resource manager */
+#define IFDH_SIMULTANEOUS_ACCESS        255
+
+/* Interval (ms) between presence polls of an idle reader */
+#ifndef IFDH_POLL_INTERVAL
+#define IFDH_POLL_INTERVAL      250
+#endif
+
+/* Interval (ms) between presence polls while pcscd waits for a change */
+#ifndef IFDH_POLL_INTERVAL_WAIT
+#define IFDH_POLL_INTERVAL_WAIT 100
+#endif
+
+/* Maximum interval (ms) the poller backs off to while reader is in use,
+   and longest time the presence cache goes without a poll */
+#ifndef IFDH_POLL_INTERVAL_MAX
+#define IFDH_POLL_INTERVAL_MAX  2000
+#endif
+
+/*
+ * Not exported macros definition
+ */
+
+#define IFDH_READER_NUMBER(Lun)	((unsigned short) ((Lun) >> 16))
+#define IFDH_SLOT_NUMBER(Lun)	((unsigned short) ((Lun) & 0x0000FFFF))
 
 /*
  * Not exported data types definition
@@ -59,26 +85,75 @@ typedef struct
   DEVICE_CAPABILITIES device_capabilities;
   ICC_STATE icc_state;
   PROTOCOL_OPTIONS protocol_options;
+  void *ct;                             /* Card-terminal, for CT_slot_data */
+  void *slot;                           /* Slot, for CT_slot_data */
 }
 IFDH_Context;
 
+typedef struct
+{
+  unsigned short ctn;                   /* CT-API terminal number */
+  unsigned short num_slots;             /* Slots present in the reader */
+  IFDH_Context *context[IFDH_MAX_SLOTS];        /* Context of each slot */
+  UCHAR presence[IFDH_MAX_SLOTS];       /* Cached ICC presence of each slot */
+  int presence_valid;                   /* Cached ICC presence is up to date */
+  unsigned long events[IFDH_MAX_SLOTS]; /* Insertions and removals seen */
+  unsigned waiters;                     /* Threads waiting for an event */
+  unsigned busy;                        /* Commands in progress */
+  int activity;                         /* Commands issued since last poll */
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t mutex;                /* Serializes access to this reader */
+  pthread_cond_t poller_cond;           /* Wakes up the poller */
+  pthread_cond_t event_cond;            /* Signals insertions and removals */
+  pthread_t poller;                     /* Presence poller thread */
+  int poller_running;                   /* Poller thread has been started */
+#endif
+}
+IFDH_Reader;
+
 /*
  * Not exported variables definition
  */
 
-/* Matrix that stores conext information of all slots and readers */
-static IFDH_Context *ifdh_context[IFDH_MAX_READERS][IFDH_MAX_SLOTS] = {
-  {NULL},{NULL},{NULL},{NULL},
-};
+/* Registry of all readers ever opened, never shrinks */
+static IFDH_Reader **ifdh_readers = NULL;
+static unsigned ifdh_num_readers = 0;
+
+/* Mutex for the registry */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t ifdh_readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Not exported functions declaration
+ */
+
+static IFDH_Reader *IFDH_GetReader (DWORD Lun, int create);
+
+static IFDH_Context *IFDH_GetContext (IFDH_Reader * reader, DWORD Lun);
+
+static unsigned short IFDH_GetNumSlots (unsigned short ctn);
+
+static char IFDH_GetPresence (unsigned short ctn, unsigned short num_slots, UCHAR * presence, UCHAR * change);
+
+static void IFDH_UpdatePresence (IFDH_Reader * reader, UCHAR * presence, UCHAR * change);
 
-/* Mutexes for all readers */
 #ifdef HAVE_PTHREAD_H
-static pthread_mutex_t ifdh_context_mutex[IFDH_MAX_READERS] = {
-  PTHREAD_MUTEX_INITIALIZER,
-  PTHREAD_MUTEX_INITIALIZER,
-  PTHREAD_MUTEX_INITIALIZER,
-  PTHREAD_MUTEX_INITIALIZER
-};
+static void IFDH_GetDeadline (struct timespec *deadline, unsigned ms);
+
+static RESPONSECODE IFDH_WaitPresence (DWORD Lun, unsigned timeout);
+
+static RESPONSECODE IFDH_PollingThread (DWORD Lun);
+
+static RESPONSECODE IFDH_PollingThreadWithTimeout (DWORD Lun, int timeout);
+
+static RESPONSECODE IFDH_StopPollingThread (DWORD Lun);
+
+static void IFDH_StartPoller (IFDH_Reader * reader);
+
+static void IFDH_StopPoller (IFDH_Reader * reader);
+
+static void *IFDH_Poller (void *arg);
 #endif
 
 /*
@@ -89,16 +164,21 @@ RESPONSECODE IFDHCreateChannel (DWORD Lun, DWORD Channel)
 {
   char ret;
   unsigned short ctn, pn, slot;
+  IFDH_Reader *reader;
   RESPONSECODE rv;
 
-  ctn = ((unsigned short) (Lun >> 16)) % IFDH_MAX_READERS;
-  slot = ((unsigned short) (Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+  reader = IFDH_GetReader (Lun, 1);
+
+  if (reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
+
+  ctn = reader->ctn;
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_lock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_lock (&(reader->mutex));
 #endif
 
-  if (ifdh_context[ctn][slot] == NULL)
+  if (reader->num_slots == 0)
     {
       /* Handle USB CHANNELID numbers */
       if (Channel >= 0x200000)
@@ -142,15 +222,30 @@ RESPONSECODE IFDHCreateChannel (DWORD Lun, DWORD Channel)
 
       if (ret == OK)
         {
+          /* Expose every slot of the reader, e.g. both of a Twin */
+          reader->num_slots = IFDH_GetNumSlots (ctn);
+
           /* Initialize context of the all slots in this reader */
-          for (slot = 0; slot < IFDH_MAX_SLOTS; slot++)
+          for (slot = 0; slot < reader->num_slots; slot++)
             {
-              ifdh_context[ctn][slot] =
+              reader->context[slot] =
                 (IFDH_Context *) malloc (sizeof (IFDH_Context));
 
-              if (ifdh_context[ctn][slot] != NULL)
-                memset (ifdh_context[ctn][slot], 0, sizeof (IFDH_Context));
+              if (reader->context[slot] != NULL)
+                {
+                  memset (reader->context[slot], 0, sizeof (IFDH_Context));
+
+                  /* Resolve once the slot APDU's are sent to */
+                  if (CT_get_slot (ctn, slot, &(reader->context[slot]->ct), 
+                                   &(reader->context[slot]->slot)) != OK)
+                    reader->context[slot]->slot = NULL;
+                }
             }
+
+          reader->presence_valid = 0;
+#ifdef HAVE_PTHREAD_H
+          IFDH_StartPoller (reader);
+#endif
           rv = IFD_SUCCESS;
         }
 
@@ -166,7 +261,7 @@ RESPONSECODE IFDHCreateChannel (DWORD Lun, DWORD Channel)
     }
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_unlock (&(reader->mutex));
 #endif
 
 #ifdef DEBUG_IFDH
@@ -181,37 +276,54 @@ RESPONSECODE
 IFDHCloseChannel (DWORD Lun)
 {
   char ret;
-  unsigned short ctn, slot;
+  unsigned short slot;
+  IFDH_Reader *reader;
   RESPONSECODE rv;
 
-  ctn = ((unsigned short) (Lun >> 16)) % IFDH_MAX_READERS;
-  slot = ((unsigned short) (Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+  reader = IFDH_GetReader (Lun, 0);
 
-  ret = CT_close (ctn);
+  if (reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
 
-  if (ret == OK)
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&(reader->mutex));
+#endif
+
+  /* Reader already closed through another of its slots */
+  if (reader->num_slots == 0)
+    rv = IFD_SUCCESS;
+
+  else
     {
 #ifdef HAVE_PTHREAD_H
-      pthread_mutex_lock (&ifdh_context_mutex[ctn]);
+      IFDH_StopPoller (reader);
 #endif
+      ret = CT_close (reader->ctn);
 
-      /* Free context of the all slots in this reader */
-      for (slot = 0; slot < IFDH_MAX_SLOTS; slot++)
+      if (ret == OK)
         {
-          if (ifdh_context[ctn][slot] != NULL)
+          /* Free context of the all slots in this reader */
+          for (slot = 0; slot < reader->num_slots; slot++)
             {
-              free (ifdh_context[ctn][slot]);
-              ifdh_context[ctn][slot] = NULL;
+              if (reader->context[slot] != NULL)
+                {
+                  free (reader->context[slot]);
+                  reader->context[slot] = NULL;
+                }
             }
+
+          reader->num_slots = 0;
+          reader->presence_valid = 0;
+          rv = IFD_SUCCESS;
         }
-#ifdef HAVE_PTHREAD_H
-      pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
-#endif
-      rv = IFD_SUCCESS;
+
+      else
+        rv = IFD_COMMUNICATION_ERROR;
     }
 
-  else
-    rv = IFD_COMMUNICATION_ERROR;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&(reader->mutex));
+#endif
 
 #ifdef DEBUG_IFDH
   syslog (LOG_INFO, "IFDH: IFDHCloseChannel(Lun=0x%X)=%d", Lun, rv);
@@ -223,35 +335,74 @@ IFDHCloseChannel (DWORD Lun)
 RESPONSECODE
 IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
 {
-  unsigned short ctn, slot;
+  IFDH_Reader *reader;
+  IFDH_Context *context;
   RESPONSECODE rv;
 
-  ctn = ((unsigned short) (Lun >> 16)) % IFDH_MAX_READERS;
-  slot = ((unsigned short) (Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+  reader = IFDH_GetReader (Lun, 0);
+
+  if (reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_lock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_lock (&(reader->mutex));
 #endif
 
+  context = IFDH_GetContext (reader, Lun);
+
   switch (Tag)
   {
     case TAG_IFD_ATR:
-    (*Length) = ifdh_context[ctn][slot]->icc_state.ATR_Length;
-    memcpy (Value, ifdh_context[ctn][slot]->icc_state.ATR, (*Length));
-    rv = IFD_SUCCESS;
+    if (context != NULL)
+      {
+        (*Length) = context->icc_state.ATR_Length;
+        memcpy (Value, context->icc_state.ATR, (*Length));
+        rv = IFD_SUCCESS;
+      }
+    else
+      {
+        (*Length) = 0;
+        rv = IFD_ICC_NOT_PRESENT;
+      }
     break;
 
     case TAG_IFD_SLOTS_NUMBER:
     (*Length) = 1;
-    (*Value) = IFDH_MAX_SLOTS;
+    (*Value) = (UCHAR) reader->num_slots;
     rv = IFD_SUCCESS;
     break;
 
     case TAG_IFD_SIMULTANEOUS_ACCESS:
     (*Length) = 1;
-    (*Value) = IFDH_MAX_READERS;
+    (*Value) = IFDH_SIMULTANEOUS_ACCESS;
+    rv = IFD_SUCCESS;
+    break;
+
+#ifdef HAVE_PTHREAD_H
+    case TAG_IFD_POLLING_THREAD:
+    (*Length) = sizeof (void *);
+    *((void **) Value) = (void *) IFDH_PollingThread;
+    rv = IFD_SUCCESS;
+    break;
+
+    case TAG_IFD_POLLING_THREAD_WITH_TIMEOUT:
+    (*Length) = sizeof (void *);
+    *((void **) Value) = (void *) IFDH_PollingThreadWithTimeout;
+    rv = IFD_SUCCESS;
+    break;
+
+    case TAG_IFD_STOP_POLLING_THREAD:
+    (*Length) = sizeof (void *);
+    *((void **) Value) = (void *) IFDH_StopPollingThread;
+    rv = IFD_SUCCESS;
+    break;
+
+    case TAG_IFD_POLLING_THREAD_KILLABLE:
+    (*Length) = 1;
+    (*Value) = 0;
     rv = IFD_SUCCESS;
     break;
+#endif
 
     default:
     (*Length) = 0;
@@ -259,7 +410,7 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
   }
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_unlock (&(reader->mutex));
 #endif
 
 #ifdef DEBUG_IFDH
@@ -287,17 +438,28 @@ IFDHSetProtocolParameters (DWORD Lun, DWORD Protocol,
   char ret;
   unsigned short ctn, slot, lc, lr;
   UCHAR cmd[10], rsp[256], sad, dad;
+  IFDH_Reader *reader;
+  IFDH_Context *context;
   RESPONSECODE rv;
 
-  ctn = ((unsigned short) (Lun >> 16)) % IFDH_MAX_READERS;
-  slot = ((unsigned short) (Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+  reader = IFDH_GetReader (Lun, 0);
+
+  if (reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
+
+  ctn = reader->ctn;
+  slot = IFDH_SLOT_NUMBER (Lun);
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_lock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_lock (&(reader->mutex));
 #endif
 
-  if (ifdh_context[ctn][slot] != NULL)
+  context = IFDH_GetContext (reader, Lun);
+
+  if (context != NULL)
     {
+      reader->activity = 1;
+
       cmd[0] = CTBCS_CLA;
       cmd[1] = CTBCS_INS_RESET;
       cmd[2] = (UCHAR) (slot + 1);
@@ -325,8 +487,8 @@ IFDHSetProtocolParameters (DWORD Lun, DWORD Protocol,
 
       if ((ret == OK) && (lr >= 2))
         {
-          ifdh_context[ctn][slot]->icc_state.ATR_Length = (DWORD) lr - 2;
-          memcpy (ifdh_context[ctn][slot]->icc_state.ATR, rsp, lr - 2);
+          context->icc_state.ATR_Length = (DWORD) lr - 2;
+          memcpy (context->icc_state.ATR, rsp, lr - 2);
 
           rv = IFD_SUCCESS;
         }
@@ -339,7 +501,7 @@ IFDHSetProtocolParameters (DWORD Lun, DWORD Protocol,
     rv = IFD_ICC_NOT_PRESENT;
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_unlock (&(reader->mutex));
 #endif
 
 #ifdef DEBUG_IFDH
@@ -356,17 +518,28 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
   char ret;
   unsigned short ctn, slot, lc, lr;
   UCHAR cmd[5], rsp[256], sad, dad;
+  IFDH_Reader *reader;
+  IFDH_Context *context;
   RESPONSECODE rv;
 
-  ctn = ((unsigned short) (Lun >> 16)) % IFDH_MAX_READERS;
-  slot = ((unsigned short) (Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+  reader = IFDH_GetReader (Lun, 0);
+
+  if (reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
+
+  ctn = reader->ctn;
+  slot = IFDH_SLOT_NUMBER (Lun);
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_lock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_lock (&(reader->mutex));
 #endif
 
-  if (ifdh_context[ctn][slot] != NULL)
+  context = IFDH_GetContext (reader, Lun);
+
+  if (context != NULL)
     {
+      reader->activity = 1;
+
       if (Action == IFD_POWER_UP)
         {
           cmd[0] = CTBCS_CLA;
@@ -384,8 +557,8 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 
           if ((ret == OK) && (lr >= 2))
             {
-              ifdh_context[ctn][slot]->icc_state.ATR_Length = (DWORD) lr - 2;
-              memcpy (ifdh_context[ctn][slot]->icc_state.ATR, rsp, lr - 2);
+              context->icc_state.ATR_Length = (DWORD) lr - 2;
+              memcpy (context->icc_state.ATR, rsp, lr - 2);
 
               (*AtrLength) = (DWORD) lr - 2;
               memcpy (Atr, rsp, lr - 2);
@@ -414,8 +587,8 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 
           if (ret == OK)
             {
-              ifdh_context[ctn][slot]->icc_state.ATR_Length = 0;
-              memset (ifdh_context[ctn][slot]->icc_state.ATR, 0, MAX_ATR_SIZE);
+              context->icc_state.ATR_Length = 0;
+              memset (context->icc_state.ATR, 0, MAX_ATR_SIZE);
 
               (*AtrLength) = 0;
               rv = IFD_SUCCESS;
@@ -442,8 +615,8 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 
           if ((ret == OK) && (lr >= 2))
             {
-              ifdh_context[ctn][slot]->icc_state.ATR_Length = (DWORD) lr - 2;
-              memcpy (ifdh_context[ctn][slot]->icc_state.ATR, rsp, lr - 2);
+              context->icc_state.ATR_Length = (DWORD) lr - 2;
+              memcpy (context->icc_state.ATR, rsp, lr - 2);
 
               (*AtrLength) = (DWORD) lr - 2;
               memcpy (Atr, rsp, lr - 2);
@@ -463,7 +636,7 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
     rv = IFD_ICC_NOT_PRESENT;
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_unlock (&(reader->mutex));
 #endif
 
 #ifdef DEBUG_IFDH
@@ -480,31 +653,64 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci,
 {
   char ret;
   unsigned short ctn, slot, lc, lr;
+  unsigned long length;
   UCHAR sad, dad;
+  IFDH_Reader *reader;
+  IFDH_Context *context;
   RESPONSECODE rv;
 
-  ctn = ((unsigned short) (Lun >> 16)) % IFDH_MAX_READERS;
-  slot = ((unsigned short) (Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+  reader = IFDH_GetReader (Lun, 0);
+
+  if (reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
+
+  ctn = reader->ctn;
+  slot = IFDH_SLOT_NUMBER (Lun);
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_lock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_lock (&(reader->mutex));
 #endif
 
-  if (ifdh_context[ctn][slot] != NULL)
+  context = IFDH_GetContext (reader, Lun);
+
+  if (context != NULL)
     {
+      /* Keep the presence poller off the line meanwhile */
+      reader->busy++;
+      reader->activity = 1;
 #ifdef HAVE_PTHREAD_H
-      pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
+      pthread_mutex_unlock (&(reader->mutex));
 #endif
-      dad = (UCHAR) ((slot == 0) ? 0x00 : slot + 1);
-      sad = 0x02;
-      lr = (unsigned short) (*RxLength);
-      lc = (unsigned short) TxLength;
+      /* Straight to the slot, no CT-API addressing */
+      if (context->slot != NULL)
+        {
+          length = (*RxLength);
+          ret = CT_slot_data (context->ct, context->slot, TxLength, TxBuffer,
+                              &length, RxBuffer);
+        }
 
-      ret = CT_data (ctn, &dad, &sad, lc, TxBuffer, &lr, RxBuffer);
+      else
+        {
+          dad = (UCHAR) ((slot == 0) ? 0x00 : slot + 1);
+          sad = 0x02;
+          lr = ((*RxLength) > 0xFFFF) ? 0xFFFF : (unsigned short) (*RxLength);
+          lc = (unsigned short) TxLength;
+
+          ret = CT_data (ctn, &dad, &sad, lc, TxBuffer, &lr, RxBuffer);
+          length = lr;
+        }
+
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_lock (&(reader->mutex));
+#endif
+      reader->busy--;
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_unlock (&(reader->mutex));
+#endif
 
       if (ret == OK)
         {
-          (*RxLength) = lr;
+          (*RxLength) = length;
           rv = IFD_SUCCESS;
         }
 
@@ -518,7 +724,7 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci,
   else
     {
 #ifdef HAVE_PTHREAD_H
-      pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
+      pthread_mutex_unlock (&(reader->mutex));
 #endif
       rv = IFD_ICC_NOT_PRESENT;
     }
@@ -535,29 +741,48 @@ IFDHControl (DWORD Lun, PUCHAR TxBuffer,
              DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength)
 {
   char ret;
-  unsigned short ctn, slot, lc, lr;
+  unsigned short ctn, lc, lr;
   UCHAR sad, dad;
+  IFDH_Reader *reader;
+  IFDH_Context *context;
   RESPONSECODE rv;
 
-  ctn = ((unsigned short) (Lun >> 16)) % IFDH_MAX_READERS;
-  slot = ((unsigned short) (Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+  reader = IFDH_GetReader (Lun, 0);
+
+  if (reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
+
+  ctn = reader->ctn;
 
 #ifdef HAVE_PTHREAD_H
-  pthread_mutex_lock (&ifdh_context_mutex[ctn]);
+  pthread_mutex_lock (&(reader->mutex));
 #endif
 
-  if (ifdh_context[ctn][slot] != NULL)
+  context = IFDH_GetContext (reader, Lun);
+
+  if (context != NULL)
     {
+      /* Keep the presence poller off the line meanwhile */
+      reader->busy++;
+      reader->activity = 1;
 #ifdef HAVE_PTHREAD_H
-      pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
+      pthread_mutex_unlock (&(reader->mutex));
 #endif
       dad = 0x01;
       sad = 0x02;
-      lr = (unsigned short) (*RxLength);
+      lr = ((*RxLength) > 0xFFFF) ? 0xFFFF : (unsigned short) (*RxLength);
       lc = (unsigned short) TxLength;
 
       ret = CT_data (ctn, &dad, &sad, lc, TxBuffer, &lr, RxBuffer);
 
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_lock (&(reader->mutex));
+#endif
+      reader->busy--;
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_unlock (&(reader->mutex));
+#endif
+
       if (ret == OK)
         {
           (*RxLength) = lr;
@@ -573,7 +798,7 @@ IFDHControl (DWORD Lun, PUCHAR TxBuffer,
   else
     {
 #ifdef HAVE_PTHREAD_H
-      pthread_mutex_unlock (&ifdh_context_mutex[ctn]);
+      pthread_mutex_unlock (&(reader->mutex));
 #endif
       rv = IFD_ICC_NOT_PRESENT;
     }
@@ -589,13 +814,135 @@ RESPONSECODE
 IFDHICCPresence (DWORD Lun)
 {
   char ret;
-  unsigned short ctn, slot, lc, lr;
-  UCHAR cmd[5], rsp[256], sad, dad;
+  unsigned short ctn, slot;
+  UCHAR presence[IFDH_MAX_SLOTS], change[IFDH_MAX_SLOTS];
+  IFDH_Reader *reader;
   RESPONSECODE rv;
 
-  ctn = ((unsigned short) (Lun >> 16)) % IFDH_MAX_READERS;
-  slot = ((unsigned short) (Lun & 0x0000FFFF)) % IFDH_MAX_SLOTS;
+  reader = IFDH_GetReader (Lun, 0);
+
+  if (reader == NULL)
+    return IFD_COMMUNICATION_ERROR;
+
+  ctn = reader->ctn;
+  slot = IFDH_SLOT_NUMBER (Lun);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&(reader->mutex));
+#endif
+
+  /* Answer from the status kept by the poller */
+  if (reader->presence_valid)
+    {
+      memcpy (presence, reader->presence, IFDH_MAX_SLOTS);
+      ret = OK;
+    }
+
+  /* No poller running or it has not refreshed the status yet */
+  else
+    {
+      ret = IFDH_GetPresence (ctn, reader->num_slots, presence, change);
+
+      /* Do not lose the change flags the poller would have seen */
+      if (ret == OK)
+        IFDH_UpdatePresence (reader, presence, change);
+    }
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&(reader->mutex));
+#endif
+
+  if (ret == OK)
+    {
+      if ((slot < IFDH_MAX_SLOTS) && presence[slot])
+        rv = IFD_ICC_PRESENT;
+      else
+        rv = IFD_ICC_NOT_PRESENT;
+    }
+  else
+    rv = IFD_COMMUNICATION_ERROR;
+
+#ifdef DEBUG_IFDH
+  syslog (LOG_INFO, "IFDH: IFDHICCPresence (Lun=0x%X)=%d", Lun, rv);
+#endif
+
+  return rv;
+}
+
+/*
+ * Not exported functions definition
+ */
+
+static IFDH_Reader *
+IFDH_GetReader (DWORD Lun, int create)
+{
+  IFDH_Reader *reader, **readers;
+  unsigned i;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&ifdh_readers_mutex);
+#endif
+
+  reader = NULL;
+
+  for (i = 0; i < ifdh_num_readers; i++)
+    {
+      if (ifdh_readers[i]->ctn == IFDH_READER_NUMBER (Lun))
+        {
+          reader = ifdh_readers[i];
+          break;
+        }
+    }
+
+  if ((reader == NULL) && create)
+    {
+      /* Register a new reader */
+      readers = (IFDH_Reader **) realloc (ifdh_readers, 
+                                          (ifdh_num_readers + 1) * sizeof (IFDH_Reader *));
+
+      if (readers != NULL)
+        {
+          ifdh_readers = readers;
+          reader = (IFDH_Reader *) malloc (sizeof (IFDH_Reader));
+        }
+
+      if (reader != NULL)
+        {
+          memset (reader, 0, sizeof (IFDH_Reader));
+          reader->ctn = IFDH_READER_NUMBER (Lun);
+#ifdef HAVE_PTHREAD_H
+          pthread_mutex_init (&(reader->mutex), NULL);
+          pthread_cond_init (&(reader->poller_cond), NULL);
+          pthread_cond_init (&(reader->event_cond), NULL);
+#endif
+          ifdh_readers[ifdh_num_readers++] = reader;
+        }
+    }
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&ifdh_readers_mutex);
+#endif
+
+  return reader;
+}
+
+static IFDH_Context *
+IFDH_GetContext (IFDH_Reader * reader, DWORD Lun)
+{
+  if (IFDH_SLOT_NUMBER (Lun) >= reader->num_slots)
+    return NULL;
+
+  return reader->context[IFDH_SLOT_NUMBER (Lun)];
+}
 
+static unsigned short
+IFDH_GetNumSlots (unsigned short ctn)
+{
+  char ret;
+  unsigned short lr;
+  UCHAR cmd[5], rsp[256], sad, dad;
+
+  /* ICC status returns one byte per slot */
   cmd[0] = CTBCS_CLA;
   cmd[1] = CTBCS_INS_STATUS;
   cmd[2] = CTBCS_P1_CT_KERNEL;
@@ -604,29 +951,298 @@ IFDHICCPresence (DWORD Lun)
 
   dad = 0x01;
   sad = 0x02;
-  lc = 5;
   lr = 256;
 
-  ret = CT_data (ctn, &dad, &sad, lc, cmd, &lr, rsp);
+  ret = CT_data (ctn, &dad, &sad, 5, cmd, &lr, rsp);
 
-  if (ret == OK)
+  if ((ret != OK) || (lr < 3))
+    return 1;
+
+  return (lr - 2 < IFDH_MAX_SLOTS) ? lr - 2 : IFDH_MAX_SLOTS;
+}
+
+static char
+IFDH_GetPresence (unsigned short ctn, unsigned short num_slots, UCHAR * presence, UCHAR * change)
+{
+  char ret;
+  unsigned short slot;
+
+  /* Reader closed */
+  if (num_slots == 0)
+    return ERR_CT;
+
+  /* Slots not in the reader have no card */
+  memset (presence, 0, IFDH_MAX_SLOTS);
+  memset (change, 0, IFDH_MAX_SLOTS);
+
+  for (slot = 0; slot < num_slots; slot++)
+    {
+      ret = CT_check (ctn, slot, presence + slot, change + slot);
+
+      if (ret != OK)
+        return ret;
+    }
+
+  return OK;
+}
+
+static void
+IFDH_UpdatePresence (IFDH_Reader * reader, UCHAR * presence, UCHAR * change)
+{
+  unsigned short slot;
+#ifdef HAVE_PTHREAD_H
+  int event = 0;
+#endif
+
+  for (slot = 0; slot < IFDH_MAX_SLOTS; slot++)
     {
-      if (slot < lr - 2)
+      /* A quick removal and insertion is only noticed by the change flag */
+      if (change[slot] || 
+          (reader->presence_valid && (presence[slot] != reader->presence[slot])))
         {
-          if (rsp[slot] == CTBCS_DATA_STATUS_NOCARD)
-            rv = IFD_ICC_NOT_PRESENT;
-          else
-            rv = IFD_ICC_PRESENT;
+          reader->events[slot]++;
+#ifdef HAVE_PTHREAD_H
+          event = 1;
+#endif
         }
-      else
-        rv = IFD_ICC_NOT_PRESENT;
     }
-  else
-    rv = IFD_COMMUNICATION_ERROR;
+
+  memcpy (reader->presence, presence, IFDH_MAX_SLOTS);
+
+#ifdef HAVE_PTHREAD_H
+  /* Cache is only kept up to date by the poller */
+  reader->presence_valid = reader->poller_running;
+
+  if (event)
+    pthread_cond_broadcast (&(reader->event_cond));
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void
+IFDH_GetDeadline (struct timespec *deadline, unsigned ms)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  deadline->tv_sec = now.tv_sec + ms / 1000;
+  deadline->tv_nsec = now.tv_usec * 1000L + (ms % 1000) * 1000000L;
+
+  if (deadline->tv_nsec >= 1000000000L)
+    {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static RESPONSECODE
+IFDH_WaitPresence (DWORD Lun, unsigned timeout)
+{
+  IFDH_Reader *reader;
+  UCHAR presence[IFDH_MAX_SLOTS], change[IFDH_MAX_SLOTS];
+  struct timespec deadline, next;
+  unsigned long events;
+  unsigned short slot;
+  int present, last;
+  RESPONSECODE rv;
+  char ret;
+
+  reader = IFDH_GetReader (Lun, 0);
+  slot = IFDH_SLOT_NUMBER (Lun);
+
+  if ((reader == NULL) || (slot >= IFDH_MAX_SLOTS))
+    return IFD_COMMUNICATION_ERROR;
+
+  if (timeout > 0)
+    IFDH_GetDeadline (&deadline, timeout);
+
+  pthread_mutex_lock (&(reader->mutex));
+
+  events = reader->events[slot];
+  reader->waiters++;
+  present = -1;
+  rv = IFD_SUCCESS;
+
+  while (events == reader->events[slot])
+    {
+      /* The poller polls faster and wakes us up on insertion or removal */
+      if (reader->poller_running)
+        {
+          if (timeout == 0)
+            pthread_cond_wait (&(reader->event_cond), &(reader->mutex));
+          else if (pthread_cond_timedwait (&(reader->event_cond), &(reader->mutex), &deadline) == ETIMEDOUT)
+            break;
+
+          continue;
+        }
+
+      /* Without it, check the slot until it changes as pcscd would */
+      pthread_mutex_unlock (&(reader->mutex));
+      ret = IFDH_GetPresence (reader->ctn, reader->num_slots, presence, change);
+      pthread_mutex_lock (&(reader->mutex));
+
+      if (ret != OK)
+        {
+          rv = IFD_COMMUNICATION_ERROR;
+          break;
+        }
+
+      IFDH_UpdatePresence (reader, presence, change);
+
+      if ((present >= 0) && (presence[slot] != present))
+        break;
+
+      present = presence[slot];
+
+      /* Sleep until the next check, but not past the timeout */
+      IFDH_GetDeadline (&next, IFDH_POLL_INTERVAL_WAIT);
+      last = (timeout > 0) && ((next.tv_sec > deadline.tv_sec) || 
+                               ((next.tv_sec == deadline.tv_sec) && (next.tv_nsec >= deadline.tv_nsec)));
+
+      if ((pthread_cond_timedwait (&(reader->event_cond), &(reader->mutex), last ? &deadline : &next) == ETIMEDOUT) && last)
+        break;
+    }
+
+  reader->waiters--;
+
+  pthread_mutex_unlock (&(reader->mutex));
 
 #ifdef DEBUG_IFDH
-  syslog (LOG_INFO, "IFDH: IFDHICCPresence (Lun=0x%X)=%d", Lun, rv);
+  syslog (LOG_INFO, "IFDH: IFDH_WaitPresence (Lun=0x%X, timeout=%u)=%d", Lun, timeout, rv);
 #endif
 
   return rv;
 }
+
+static RESPONSECODE
+IFDH_PollingThread (DWORD Lun)
+{
+  return IFDH_WaitPresence (Lun, 0);
+}
+
+static RESPONSECODE
+IFDH_PollingThreadWithTimeout (DWORD Lun, int timeout)
+{
+  return IFDH_WaitPresence (Lun, (timeout > 0) ? (unsigned) timeout : 0);
+}
+
+static RESPONSECODE
+IFDH_StopPollingThread (DWORD Lun)
+{
+  IFDH_Reader *reader;
+  unsigned short slot;
+
+  reader = IFDH_GetReader (Lun, 0);
+  slot = IFDH_SLOT_NUMBER (Lun);
+
+  if ((reader == NULL) || (slot >= IFDH_MAX_SLOTS))
+    return IFD_COMMUNICATION_ERROR;
+
+  /* Fake an event so that the waiting thread returns */
+  pthread_mutex_lock (&(reader->mutex));
+  reader->events[slot]++;
+  pthread_cond_broadcast (&(reader->event_cond));
+  pthread_mutex_unlock (&(reader->mutex));
+
+  return IFD_SUCCESS;
+}
+
+static void
+IFDH_StartPoller (IFDH_Reader * reader)
+{
+  reader->poller_running = 1;
+
+  if (pthread_create (&(reader->poller), NULL, IFDH_Poller, reader) != 0)
+    reader->poller_running = 0;
+}
+
+static void
+IFDH_StopPoller (IFDH_Reader * reader)
+{
+  if (!reader->poller_running)
+    return;
+
+  reader->poller_running = 0;
+  pthread_cond_signal (&(reader->poller_cond));
+  pthread_cond_broadcast (&(reader->event_cond));
+
+  /* Poller needs the reader mutex to finish */
+  pthread_mutex_unlock (&(reader->mutex));
+  pthread_join (reader->poller, NULL);
+  pthread_mutex_lock (&(reader->mutex));
+
+  reader->presence_valid = 0;
+}
+
+static void *
+IFDH_Poller (void *arg)
+{
+  IFDH_Reader *reader;
+  UCHAR presence[IFDH_MAX_SLOTS], change[IFDH_MAX_SLOTS];
+  struct timespec deadline, polled, now;
+  unsigned short slot;
+  unsigned interval;
+  long elapsed;
+  char ret;
+
+  reader = (IFDH_Reader *) arg;
+  interval = IFDH_POLL_INTERVAL;
+
+  /* Time of the last successful poll */
+  IFDH_GetDeadline (&polled, 0);
+
+  pthread_mutex_lock (&(reader->mutex));
+
+  while (reader->poller_running)
+    {
+      IFDH_GetDeadline (&deadline, interval);
+      pthread_cond_timedwait (&(reader->poller_cond), &(reader->mutex), &deadline);
+
+      if (!reader->poller_running)
+        break;
+
+      IFDH_GetDeadline (&now, 0);
+      elapsed = (now.tv_sec - polled.tv_sec) * 1000L + (now.tv_nsec - polled.tv_nsec) / 1000000L;
+
+      /* Back off while commands keep the reader busy, but never past the longest interval */
+      if (((reader->busy > 0) || reader->activity) && (elapsed < IFDH_POLL_INTERVAL_MAX))
+        {
+          reader->activity = 0;
+          interval = (2 * interval < IFDH_POLL_INTERVAL_MAX) ? 2 * interval : IFDH_POLL_INTERVAL_MAX;
+          continue;
+        }
+
+      /* Poll faster when someone is waiting for insertion or removal */
+      interval = (reader->waiters > 0) ? IFDH_POLL_INTERVAL_WAIT : IFDH_POLL_INTERVAL;
+
+      pthread_mutex_unlock (&(reader->mutex));
+      ret = IFDH_GetPresence (reader->ctn, reader->num_slots, presence, change);
+      pthread_mutex_lock (&(reader->mutex));
+
+      if (ret == OK)
+        {
+          IFDH_GetDeadline (&polled, 0);
+          IFDH_UpdatePresence (reader, presence, change);
+        }
+
+      /* Let waiters find out about the error, but only once */
+      else if (reader->presence_valid)
+        {
+          reader->presence_valid = 0;
+
+          for (slot = 0; slot < IFDH_MAX_SLOTS; slot++)
+            reader->events[slot]++;
+
+          pthread_cond_broadcast (&(reader->event_cond));
+        }
+
+#ifdef DEBUG_IFDH
+      syslog (LOG_INFO, "IFDH: IFDH_Poller (ctn=%d)=%d", reader->ctn, ret);
+#endif
+    }
+
+  pthread_mutex_unlock (&(reader->mutex));
+
+  return NULL;
+}
+#endif
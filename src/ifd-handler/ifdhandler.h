@@ -82,6 +82,10 @@ extern "C" {
 #define TAG_IFD_SLOTNUM                 0x0180
 #define TAG_IFD_SLOTS_NUMBER            0x0FAE
 #define TAG_IFD_SIMULTANEOUS_ACCESS	0x0FAF
+#define TAG_IFD_POLLING_THREAD          0x0FB0
+#define TAG_IFD_POLLING_THREAD_KILLABLE 0x0FB1
+#define TAG_IFD_STOP_POLLING_THREAD     0x0FB2
+#define TAG_IFD_POLLING_THREAD_WITH_TIMEOUT     0x0FB3
   
   /* End of tag list                          */
 
@@ -0,0 +1,105 @@
+/*
+    Micro-benchmark of the inverse convention conversion of the driver.
+    Times the shift and mask form and the table form of the loop in
+    ICC_Async_InvertCopy. Built on request with: make invert
+    Pass CFLAGS to compare optimization levels, f.i. make invert CFLAGS=-O1
+
+    This file is part of the Unix driver for Towitoko smartcard readers
+    Copyright (C) 2000 Carlos Prados <cprados@yahoo.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "defines.h"
+
+/* Bytes converted per pass */
+#define INVERT_SIZE	65536
+
+/* Passes timed when not given on the command line */
+#define INVERT_PASSES	2000
+
+static BYTE invert_table[256];
+static BYTE buffer1[INVERT_SIZE], buffer2[INVERT_SIZE];
+
+static void
+InvertShift (unsigned size, BYTE * from, BYTE * to)
+{
+  unsigned i;
+
+  for (i = 0; i < size; i++)
+    to[i] = ~(INVERT_BYTE (from[i]));
+}
+
+static void
+InvertTable (unsigned size, BYTE * from, BYTE * to)
+{
+  unsigned i;
+
+  for (i = 0; i < size; i++)
+    to[i] = invert_table[from[i]];
+}
+
+static double
+Measure (void (*invert) (unsigned, BYTE *, BYTE *), unsigned passes)
+{
+  clock_t start;
+  unsigned pass;
+
+  start = clock ();
+
+  /* Each pass converts the result of the previous one */
+  for (pass = 0; pass < passes; pass++)
+    {
+      if (pass % 2 == 0)
+	invert (INVERT_SIZE, buffer1, buffer2);
+      else
+	invert (INVERT_SIZE, buffer2, buffer1);
+    }
+
+  return (double) (clock () - start) / CLOCKS_PER_SEC;
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned passes, i;
+  double shift, table;
+
+  passes = (argc > 1) ? (unsigned) atoi (argv[1]) : INVERT_PASSES;
+
+  /* Same contents as icc_async_invert_table in icc_async.c */
+  for (i = 0; i < 256; i++)
+    invert_table[i] = ~(INVERT_BYTE (i));
+
+  for (i = 0; i < INVERT_SIZE; i++)
+    buffer1[i] = (BYTE) rand ();
+
+  shift = Measure (InvertShift, passes);
+  table = Measure (InvertTable, passes);
+
+  /* Printing a result keeps the compiler from dropping the loops */
+  printf ("%u passes of %u bytes (check %02X)\n", passes, INVERT_SIZE,
+	  buffer1[INVERT_SIZE / 2] ^ buffer2[INVERT_SIZE / 2]);
+  printf ("shift and mask: %.3f s\n", shift);
+  printf ("table:          %.3f s\n", table);
+
+  return 0;
+}
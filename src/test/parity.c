@@ -0,0 +1,203 @@
+/*
+    Test of the parity kept by the driver for the slots of a Chipdrive
+    Twin. Both slots share the serial device, so a card of inverse
+    convention in one slot and a card of direct convention in the other
+    must switch the reader parity every time they alternate.
+    The reader is played by a record replayed through the serial device,
+    which fails as soon as the driver writes anything not recorded.
+    Built on request with: make parity && ./parity
+
+    This file is part of the Unix driver for Towitoko smartcard readers
+    Copyright (C) 2000 Carlos Prados <cprados@yahoo.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "defines.h"
+#include "io_serial.h"
+#include "ifd_towitoko.h"
+
+/* Times the two cards alternate */
+#define PARITY_ROUNDS	3
+
+/* Last byte of the record, read back to check nothing was left over */
+#define PARITY_END	0x5A
+
+/*
+ * Reader side of the record
+ */
+
+static BYTE
+Checksum (BYTE * command, unsigned size, BYTE initial)
+{
+  BYTE checksum, x7;
+  unsigned i;
+
+  /* Same as IFD_Towitoko_Checksum */
+  checksum = initial;
+  for (i = 0; i < size; i++)
+    {
+      checksum = checksum ^ command[i];
+      x7 = (checksum & 0x80) >> 7;
+      checksum = checksum << 1;
+      checksum = (x7 == 0x00) ? checksum | 0x01 : checksum & 0xFE;
+    }
+
+  return checksum;
+}
+
+static void
+RecordInfo (IO_Serial * record, BYTE slot)
+{
+  BYTE command[2] = { 0x00, 0x00 };
+  BYTE answer[3] = { IFD_TOWITOKO_CHIPDRIVE_EXT_II, 0x01, 0x00 };
+
+  command[1] = Checksum (command, 1, slot);
+
+  IO_Serial_Trace (record, IO_SERIAL_TRACE_OUT, 2, command);
+  IO_Serial_Trace (record, IO_SERIAL_TRACE_IN, 3, answer);
+}
+
+static void
+RecordParity (IO_Serial * record, BYTE slot, BYTE parity)
+{
+  BYTE command[5] = { 0x6F, 0x00, 0x6A, 0x0F, 0x00 };
+  BYTE status[1] = { 0x01 };
+
+  command[1] = parity;
+  command[4] = Checksum (command, 4, slot);
+
+  IO_Serial_Trace (record, IO_SERIAL_TRACE_OUT, 5, command);
+  IO_Serial_Trace (record, IO_SERIAL_TRACE_IN, 1, status);
+}
+
+/*
+ * Driver side
+ */
+
+static int failures = 0;
+
+static void
+Check (IFD * ifd, BYTE parity, const char *what)
+{
+  IO_Serial_Properties props;
+  BYTE serial;
+  int ret;
+
+  ret = IFD_Towitoko_SetParity (ifd, parity);
+
+  serial = (parity == IFD_TOWITOKO_PARITY_ODD) ? IO_SERIAL_PARITY_ODD : IO_SERIAL_PARITY_EVEN;
+
+  if ((ret != IFD_TOWITOKO_OK) ||
+      !IO_Serial_GetProperties (ifd->io, &props) || (props.parity != serial))
+    {
+      printf ("FAIL: slot %c %s\n", ifd->slot == IFD_TOWITOKO_SLOT_A ? 'A' : 'B', what);
+      failures++;
+    }
+}
+
+int
+main (void)
+{
+  IO_Serial *record, *io;
+  IFD *slot_a, *slot_b;
+  char filename[] = "/tmp/parityXXXXXX";
+  BYTE end[1] = { PARITY_END };
+  int fd, i;
+
+  fd = mkstemp (filename);
+
+  if (fd < 0)
+    return 1;
+
+  close (fd);
+
+  /* What the reader is expected to see, in order */
+  record = IO_Serial_New ();
+  IO_Serial_SetTrace (record, TRUE);
+
+  RecordParity (record, IFD_TOWITOKO_SLOT_A, IFD_TOWITOKO_PARITY_EVEN);
+  RecordInfo (record, IFD_TOWITOKO_SLOT_A);
+  RecordParity (record, IFD_TOWITOKO_SLOT_B, IFD_TOWITOKO_PARITY_EVEN);
+  RecordInfo (record, IFD_TOWITOKO_SLOT_B);
+
+  for (i = 0; i < PARITY_ROUNDS; i++)
+    {
+      RecordParity (record, IFD_TOWITOKO_SLOT_A, IFD_TOWITOKO_PARITY_ODD);
+      RecordParity (record, IFD_TOWITOKO_SLOT_B, IFD_TOWITOKO_PARITY_EVEN);
+    }
+
+  /* After a reopen the parity of the reader is sent again */
+  RecordParity (record, IFD_TOWITOKO_SLOT_B, IFD_TOWITOKO_PARITY_EVEN);
+  IO_Serial_Trace (record, IO_SERIAL_TRACE_IN, 1, end);
+
+  if (!IO_Serial_DumpTrace (record, filename))
+    {
+      unlink (filename);
+      return 1;
+    }
+
+  IO_Serial_Delete (record);
+
+  setenv ("TOWITOKO_REPLAY", filename, 1);
+
+  io = IO_Serial_New ();
+  slot_a = IFD_Towitoko_New ();
+  slot_b = IFD_Towitoko_New ();
+
+  if ((io == NULL) || (slot_a == NULL) || (slot_b == NULL) ||
+      !IO_Serial_Init (io, 1, FALSE, FALSE) ||
+      (IFD_Towitoko_Init (slot_a, io, IFD_TOWITOKO_SLOT_A) != IFD_TOWITOKO_OK) ||
+      (IFD_Towitoko_Init (slot_b, io, IFD_TOWITOKO_SLOT_B) != IFD_TOWITOKO_OK))
+    {
+      printf ("FAIL: init\n");
+      unlink (filename);
+      return 1;
+    }
+
+  /* Inverse convention card in slot A, direct convention card in slot B */
+  for (i = 0; i < PARITY_ROUNDS; i++)
+    {
+      Check (slot_a, IFD_TOWITOKO_PARITY_ODD, "inverse card");
+      Check (slot_a, IFD_TOWITOKO_PARITY_ODD, "inverse card, no change");
+      Check (slot_b, IFD_TOWITOKO_PARITY_EVEN, "direct card");
+      Check (slot_b, IFD_TOWITOKO_PARITY_EVEN, "direct card, no change");
+    }
+
+  IFD_Towitoko_ForgetParity (slot_b);
+  Check (slot_b, IFD_TOWITOKO_PARITY_EVEN, "direct card after reopen");
+
+  if (!IO_Serial_Read (io, 0, 1, end) || (end[0] != PARITY_END))
+    {
+      printf ("FAIL: record not used up\n");
+      failures++;
+    }
+
+  IO_Serial_Close (io);
+  IO_Serial_Delete (io);
+  IFD_Towitoko_Delete (slot_a);
+  IFD_Towitoko_Delete (slot_b);
+  unlink (filename);
+
+  printf ("%s\n", failures == 0 ? "PASS" : "FAIL");
+
+  return (failures == 0) ? 0 : 1;
+}
@@ -56,6 +56,7 @@ struct
   unsigned char atr[33];        /* ATR bytes */
   unsigned short atr_size;      /* ATR size */
   unsigned char cla;		/* Class byte for commands */
+  unsigned char trace;		/* Trace of the traffic being recorded */
 #if defined HAVE_PTHREAD_H && defined MULTI_THREAD
   pthread_t thread;             /* Monitoring thread for this ctn */
   pthread_mutex_t mutex;        /* Mutex for accessin this element */
@@ -81,6 +82,9 @@ void EnterPin (unsigned short);
 void ChangePin (unsigned short);
 void ReadData (unsigned short);
 void WriteData (unsigned short);
+void Trace (unsigned short);
+void DumpTrace (unsigned short);
+void Statistics (unsigned short);
 
 #if defined HAVE_PTHREAD_H && defined MULTI_THREAD
 /* Asynchronous monitoring thread function */
@@ -107,12 +111,17 @@ main (int argc, char *argv[])
 {
   unsigned short ctn;
 
+  /* Decode a trace file written by the driver */
+  if ((argc == 3) && (strcmp (argv[1], "-t") == 0))
+    return (CT_trace_print (argv[2]) == OK) ? 0 : 1;
+
   /* Initialize status of ct's */
   for (ctn = 0; ctn < 4; ctn++)
     {
       ct_list[ctn].pn = 0;
       ct_list[ctn].status = -1;
       ct_list[ctn].cla = CLASS;
+      ct_list[ctn].trace = 0;
       memset (ct_list[ctn].port, 0, 16);
       memset (ct_list[ctn].atr, 0, 33);
       ct_list[ctn].atr_size = 0;
@@ -144,7 +153,6 @@ menu_loop (void)
 {
   char option[32];
   unsigned short ctn = 0, i;
-  int dummy;
 
   while (1)
     {
@@ -159,6 +167,10 @@ menu_loop (void)
       /* Port is open */
       if (ct_list[ctn].pn != 0)
         {
+          printf ("tr: Start/stop trace (current: %s)\n", ct_list[ctn].trace ? "on" : "off");
+          printf ("td: Dump trace to file\n");
+          printf ("st: Show driver statistics\n");
+
           /* Processor cards menu */
           if (ct_list[ctn].status == 1)
             {
@@ -191,7 +203,7 @@ menu_loop (void)
 
       /* Get  menu option */
       scanf ("%s", option);
-      dummy = getchar ();
+      getchar ();
 
       /* Convert input to lowercase */
       for (i = 0; option[i]; i++)
@@ -210,6 +222,15 @@ menu_loop (void)
       else if (strcmp (option, "cl") == 0)
         Close (ctn);
 
+      else if ((strcmp (option, "tr") == 0) && (ct_list[ctn].pn != 0))
+        Trace (ctn);
+
+      else if ((strcmp (option, "td") == 0) && (ct_list[ctn].pn != 0))
+        DumpTrace (ctn);
+
+      else if ((strcmp (option, "st") == 0) && (ct_list[ctn].pn != 0))
+        Statistics (ctn);
+
       /* Processor card options */
       if (ct_list[ctn].status == 1)
         {
@@ -704,15 +725,115 @@ Close (unsigned short ctn)
     printf ("Error closing terminal at %s\n", ct_list[ctn].port);
 }
 
+void
+Trace (unsigned short ctn)
+{
+  char ret;
+
+  ret = CT_trace (ctn, !ct_list[ctn].trace);
+
+  if (ret != OK)
+    printf ("Error starting/stopping trace: %d\n", ret);
+  else
+    ct_list[ctn].trace = !ct_list[ctn].trace;
+}
+
+void
+DumpTrace (unsigned short ctn)
+{
+  char filename[256];
+  char ret;
+
+  printf ("File name: ");
+  scanf ("%255s", filename);
+  getchar ();
+
+  ret = CT_trace_dump (ctn, filename);
+
+  if (ret != OK)
+    printf ("Error dumping trace: %d\n", ret);
+  else
+    printf ("Trace written, decode it with: tester -t %s\n", filename);
+}
+
+void
+Statistics (unsigned short ctn)
+{
+  static const char *counters[] = {
+    "IO reads", "IO writes", "IO bytes in", "IO bytes out", "IO timeouts",
+    "IO errors", "Reader commands", "Reader baudrate changes",
+    "Reader parity changes", "ICC resets", "ICC transmissions",
+    "ICC receptions", "T=0 TPDUs", "T=0 NULL bytes", "T=0 GET RESPONSEs",
+    "T=1 blocks sent", "T=1 blocks received", "T=1 WTX requests",
+    "T=1 errors", "CT-API commands", "CT-API errors",
+    "Reader trips", "Rejected commands", "IO reopens",
+    "Unchanged bytes skipped"
+  };
+  static const char *histograms[] = {
+    "IO read", "ICC receive", "ICC command", "CT-API lock wait",
+    "CT-API command"
+  };
+  unsigned char get_status[5] = { CTBCS_CLA, CTBCS_INS_STATUS, CTBCS_P1_CT_KERNEL, CTBCS_P2_STATUS_COUNTERS, 0x00 };
+  unsigned char res[258];
+  unsigned char dad, sad;
+  unsigned short lr;
+  unsigned long value;
+  unsigned i, j, length;
+  char ret;
+
+  for (i = 0; i <= sizeof (histograms) / sizeof (histograms[0]); i++)
+    {
+      get_status[3] = CTBCS_P2_STATUS_COUNTERS + i;
+      dad = 1;
+      sad = 2;
+      lr = sizeof (res);
+
+      ret = CT_data (ctn, &dad, &sad, 5, get_status, &lr, res);
+
+      if ((ret != OK) || (lr < 2) || (res[lr - 2] != CTBCS_SW1_OK))
+        {
+          fprintf (stderr, "Error on GET STATUS: %d\n", ret);
+          return;
+        }
+
+      /* Data without the status bytes */
+      length = lr - 2;
+
+      for (j = 0; j + 4 <= length; j += 4)
+        {
+          value = ((unsigned long) res[j] << 24) | ((unsigned long) res[j + 1] << 16) |
+            ((unsigned long) res[j + 2] << 8) | res[j + 3];
+
+          /* Counters */
+          if (i == 0)
+            {
+              if (j / 4 < sizeof (counters) / sizeof (counters[0]))
+                printf ("%-24s %lu\n", counters[j / 4], value);
+            }
+
+          /* Histogram: count, total (ms), max (us), then buckets */
+          else if (j == 0)
+            printf ("%s: %lu times", histograms[i - 1], value);
+          else if (j == 4)
+            printf (", total %lu ms", value);
+          else if (j == 8)
+            printf (", max %lu us\n", value);
+          else if ((value > 0) && (j + 4 == length))
+            printf ("  >= %lu us: %lu\n", 1UL << (j / 4 - 4), value);
+          else if (value > 0)
+            printf ("  < %lu us: %lu\n", 1UL << (j / 4 - 3), value);
+        }
+    }
+}
+
 void
 SelectClass (unsigned short ctn)
 {
   unsigned char buffer[32];
-  int dummy;
 
   printf ("Class byte (current is %02X): ", ct_list[ctn].cla);
   scanf ("%X", (unsigned int *) buffer);
-  dummy = getchar ();
+  getchar ();
 
 #if defined HAVE_PTHREAD_H && defined MULTI_THREAD
     pthread_mutex_lock (&(ct_list[ctn].mutex));
@@ -732,14 +853,13 @@ SelectFile (unsigned short ctn)
   unsigned char dad;
   unsigned char sad;
   unsigned short lr;
-  int dummy;
   char ret;
 
   select_file[0] = ct_list[ctn].cla;
 
   printf ("File ID: ");
   scanf ("%X %X", (unsigned int *) buffer, (unsigned int *) (buffer + 1));
-  dummy = getchar ();
+  getchar ();
 
   select_file[5] = buffer[0];
   select_file[6] = buffer[1];
@@ -772,14 +892,13 @@ GetResponse (unsigned short ctn)
   unsigned char dad;
   unsigned char sad;
   unsigned short lr;
-  int dummy;
   char ret;
 
   get_response[0] = ct_list[ctn].cla;
 
   printf ("Response size (hexadecimal): ");
   scanf ("%X", (unsigned int *) buffer);
-  dummy = getchar ();
+  getchar ();
   get_response[4] = buffer[0];
 
   dad = 0;
@@ -810,19 +929,19 @@ UpdateBinary (unsigned short ctn)
   unsigned char dad;
   unsigned char sad;
   unsigned short lr;
-  int size, dummy;
+  int size;
   char ret;
 
   update_binary[0] =  ct_list[ctn].cla;
 
   printf ("File size (0..255): ");
   scanf ("%d", &size);
-  dummy = getchar ();
+  getchar ();
   update_binary[4] = (unsigned char) (size % 256);
 
   printf ("Data: ");
   scanf ("%02X", (unsigned int *) buffer);
-  dummy = getchar ();
+  getchar ();
 
   memset(update_binary + 5, buffer[0], update_binary[4]);
 
@@ -854,7 +973,6 @@ ReadBinary (unsigned short ctn)
   unsigned char dad;
   unsigned char sad;
   unsigned short lr;
-  int dummy;
   char ret;
 
   read_binary[0] = ct_list[ctn].cla;
@@ -862,7 +980,7 @@ ReadBinary (unsigned short ctn)
   /* Read binary */
   printf ("File size: ");
   scanf ("%X", (unsigned int *) buffer);
-  dummy = getchar ();
+  getchar ();
   read_binary[4] = buffer[0];
 
   dad = 0;
@@ -922,12 +1040,11 @@ SendPPS (unsigned short ctn)
   unsigned char buffer[32], res[256];
   unsigned char dad, sad;
   unsigned short lr;
-  int dummy;
   char ret;
 
   printf ("PPS request (PPSS PPS0 PPS1): ");
   scanf ("%X %X %X", (unsigned int *) buffer, (unsigned int *) (buffer + 1), (unsigned int *) (buffer + 2));
-  dummy = getchar ();
+  getchar ();
 
   reset[5] = buffer[0];
   reset[6] = buffer[1];
@@ -961,12 +1078,11 @@ EnterPin (unsigned short ctn)
   unsigned char dad;
   unsigned char sad;
   unsigned short lr;
-  int dummy;
   char ret;
 
   printf ("PIN (3 bytes): ");
   scanf ("%X %X %X", (unsigned int *) buffer,  (unsigned int *) (buffer + 1), (unsigned int *) (buffer + 2));
-  dummy = getchar ();
+  getchar ();
 
   verify[5] = buffer[0];
   verify[6] = buffer[1];
@@ -1001,12 +1117,11 @@ ChangePin (unsigned short ctn)
   unsigned char dad;
   unsigned char sad;
   unsigned short lr;
-  int dummy;
   char ret;
 
   printf ("PIN (3 bytes): ");
   scanf ("%X %X %X", (unsigned int *) buffer, (unsigned int *) (buffer + 1), (unsigned int *) (buffer + 2));
-  dummy = getchar ();
+  getchar ();
 
   change[5] = buffer[0];
   change[6] = buffer[1];
@@ -1014,7 +1129,7 @@ ChangePin (unsigned short ctn)
 
   printf ("New PIN (3 bytes): ");
   scanf ("%X %X %X", (unsigned int *) buffer, (unsigned int *) (buffer + 1), (unsigned int *) (buffer + 2));
-  dummy = getchar ();
+  getchar ();
 
   change[8] = buffer[0];
   change[9] = buffer[1];
@@ -1050,12 +1165,11 @@ ReadData (unsigned short ctn)
   unsigned char dad;
   unsigned char sad;
   unsigned short lr, lc;
-  int dummy;
   char ret;
 
   printf ("Address: ");
   scanf ("%d", &address);
-  dummy = getchar ();
+  getchar ();
 
   read_binary[2] = (unsigned char) (address >> 8);
   read_binary[3] = (unsigned char) (address & 0x00FF);
@@ -1064,7 +1178,7 @@ ReadData (unsigned short ctn)
 
   printf ("Size (0..%d): ", total_size);
   scanf ("%d", &size);
-  dummy = getchar ();
+  getchar ();
 
   if (size < 256)
   {
@@ -1140,22 +1254,21 @@ WriteData (unsigned short ctn)
   unsigned char dad;
   unsigned char sad;
   unsigned short lr, lc;
-  int dummy;
   char ret;
 
   printf ("Address: ");
   scanf ("%d", &address);
-  dummy = getchar ();
+  getchar ();
 
   total_size  = GetMemoryLength(ct_list[ctn].atr, ct_list[ctn].atr_size);
 
   printf ("Size (0..%d): ", total_size);
   scanf ("%d", &size);
-  dummy = getchar ();
+  getchar ();
 
   printf ("Data: ");
   scanf ("%X", (unsigned int *) buffer);
-  dummy = getchar ();
+  getchar ();
 
   if  (size < 256)
   {